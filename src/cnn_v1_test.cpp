@@ -3,15 +3,24 @@
 //
 
 #include "uct/detail/cnn_v1.hpp"
+#include "uct/detail/cnn_batch.hpp"
+#include "uct/detail/conv_evaluator.hpp"
 #include <board.hpp>
 #include <gtest/gtest.h>
 #include <boost/asio.hpp>
+#include <boost/crc.hpp>
 #include <string>
 #include <cstdint>
 #include <thread>
 #include <chrono>
 #include <string>
 #include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <condition_variable>
+#include <future>
+#include <mutex>
 
 using namespace boost::asio;
 class Stub
@@ -90,6 +99,267 @@ TEST(CNNBaseTest, TestCNNBaseConstruct)
         t.join();
 }
 
+// Serves `frames` length-prefixed requests per accepted connection, for `conns` connections
+class KeepAliveStub
+{
+    io_service service;
+    ip::tcp::acceptor acceptor;
+    const std::string reply;
+public:
+    std::vector<std::string> echoes;
+    std::size_t accept_cnt = 0;
+    KeepAliveStub(unsigned short port, std::string reply):
+            acceptor(service, ip::tcp::endpoint(ip::address::from_string("127.0.0.1"), port)),
+            reply(reply)
+    {
+    }
+
+    void run(std::size_t conns, std::size_t frames)
+    {
+        for (std::size_t c = 0; c < conns; ++c)
+        {
+            ip::tcp::socket sock(service);
+            acceptor.accept(sock);
+            ++accept_cnt;
+            for (std::size_t f = 0; f < frames; ++f)
+            {
+                std::int64_t len;
+                read(sock, buffer(&len, 8));
+                std::string buf(len, '\0');
+                read(sock, buffer(&buf[0], len));
+                echoes.push_back(buf);
+                std::int64_t reply_size = reply.size();
+                write(sock, buffer(&reply_size, 8));
+                write(sock, buffer(reply));
+            }
+            sock.close();
+        }
+    }
+};
+
+TEST(CNNBaseTest, TestKeepAliveReusesConnection)
+{
+    uct::detail::CNNServiceBase cnnbase("127.0.0.1", 7594, uct::detail::ConnectionMode::KEEP_ALIVE);
+    KeepAliveStub stub(7594, "pong");
+    std::thread t {&KeepAliveStub::run, &stub, 1, 3};
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    for (int i=0; i<3; ++i)
+        EXPECT_EQ("pong", cnnbase.sync_call("ping" + std::to_string(i)));
+    if (t.joinable())
+        t.join();
+    EXPECT_EQ(1u, stub.accept_cnt);
+    EXPECT_EQ(1u, cnnbase.getConnectCount());
+    ASSERT_EQ(3u, stub.echoes.size());
+    EXPECT_EQ("ping2", stub.echoes[2]);
+}
+
+TEST(CNNBaseTest, TestKeepAliveReconnectsAfterServerClose)
+{
+    uct::detail::CNNServiceBase cnnbase("127.0.0.1", 7595, uct::detail::ConnectionMode::KEEP_ALIVE);
+    KeepAliveStub stub(7595, "pong");
+    std::thread t {&KeepAliveStub::run, &stub, 2, 1}; // server closes after every frame
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_EQ("pong", cnnbase.sync_call("first"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_EQ("pong", cnnbase.sync_call("second"));
+    if (t.joinable())
+        t.join();
+    EXPECT_EQ(2u, stub.accept_cnt);
+    EXPECT_EQ(2u, cnnbase.getConnectCount());
+}
+
+// Answers one frame, writing the reply in chunks of `chunk` bytes with pauses so the client sees many segments
+class FramingStub
+{
+    io_service service;
+    ip::tcp::acceptor acceptor;
+    const std::string reply;
+    const std::size_t chunk;
+    const bool crc;
+public:
+    std::string echo;
+    bool echo_crc_ok = false;
+    std::int64_t claimed_len = -1; // reply length to announce; -1: the real one
+    bool corrupt_crc = false;
+
+    FramingStub(unsigned short port, std::string reply, std::size_t chunk, bool crc):
+            acceptor(service, ip::tcp::endpoint(ip::address::from_string("127.0.0.1"), port)),
+            reply(reply), chunk(chunk), crc(crc)
+    {
+    }
+
+    static std::uint32_t crc32(const std::string &s)
+    {
+        boost::crc_32_type sum;
+        sum.process_bytes(s.data(), s.size());
+        return sum.checksum();
+    }
+
+    void run()
+    {
+        ip::tcp::socket sock(service);
+        acceptor.accept(sock);
+        std::int64_t len;
+        read(sock, buffer(&len, 8));
+        echo.assign(len, '\0');
+        read(sock, buffer(&echo[0], len));
+        if (crc)
+        {
+            std::uint32_t got;
+            read(sock, buffer(&got, 4));
+            echo_crc_ok = got == crc32(echo);
+        }
+
+        std::int64_t reply_size = claimed_len >= 0 ? claimed_len : (std::int64_t) reply.size();
+        std::string frame((const char *)&reply_size, 8);
+        frame += reply;
+        if (crc)
+        {
+            std::uint32_t sum = crc32(reply) ^ (corrupt_crc ? 1 : 0);
+            frame.append((const char *)&sum, 4);
+        }
+        for (std::size_t i=0; i<frame.size(); i += chunk)
+        {
+            write(sock, buffer(frame.data() + i, std::min(chunk, frame.size() - i)));
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        boost::system::error_code ec;
+        read(sock, buffer(&len, 8), ec); // until the client hangs up
+    }
+};
+
+TEST(CNNBaseTest, TestSegmentedReplyIsReadWhole)
+{
+    std::string reply(4000, 'x');
+    reply[3999] = 'y';
+    FramingStub stub(7601, reply, 100, true);
+    std::thread t {&FramingStub::run, &stub};
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    uct::detail::FrameConfig frame;
+    frame.crc = true;
+    uct::detail::CNNServiceBase cnnbase("127.0.0.1", 7601, uct::detail::ConnectionMode::ONE_SHOT, 64, frame);
+    EXPECT_EQ(reply, cnnbase.sync_call("ping"));
+    if (t.joinable())
+        t.join();
+    EXPECT_EQ("ping", stub.echo);
+    EXPECT_TRUE(stub.echo_crc_ok);
+}
+
+TEST(CNNBaseTest, TestMalformedFramesAreRejected)
+{
+    uct::detail::FrameConfig frame;
+    frame.crc = true;
+    frame.max_frame_size = 1024;
+    {
+        FramingStub stub(7602, "pong", 1024, true);
+        stub.corrupt_crc = true;
+        std::thread t {&FramingStub::run, &stub};
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        uct::detail::CNNServiceBase cnnbase("127.0.0.1", 7602, uct::detail::ConnectionMode::ONE_SHOT, 64, frame);
+        EXPECT_THROW(cnnbase.sync_call("ping"), uct::detail::CNNFrameError);
+        if (t.joinable())
+            t.join();
+    }
+    {
+        FramingStub stub(7603, "pong", 1024, true);
+        stub.claimed_len = 1 << 30;
+        std::thread t {&FramingStub::run, &stub};
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        uct::detail::CNNServiceBase cnnbase("127.0.0.1", 7603, uct::detail::ConnectionMode::ONE_SHOT, 64, frame);
+        EXPECT_THROW(cnnbase.sync_call("ping"), uct::detail::CNNFrameError);
+        if (t.joinable())
+            t.join();
+    }
+}
+
+// Answers batched compact requests: every request gets a ResponseV2 whose only possibility is its first position value
+class BatchStub
+{
+    io_service service;
+    ip::tcp::acceptor acceptor;
+    const std::size_t board_size;
+public:
+    std::vector<std::size_t> batch_sizes;
+    BatchStub(unsigned short port, std::size_t board_size):
+            acceptor(service, ip::tcp::endpoint(ip::address::from_string("127.0.0.1"), port)),
+            board_size(board_size)
+    {
+    }
+
+    void run(std::size_t frames)
+    {
+        ip::tcp::socket sock(service);
+        acceptor.accept(sock);
+        const std::size_t one_size = uct::detail::RequestV2ServiceCompact::compact_size(board_size);
+        for (std::size_t f = 0; f < frames; ++f)
+        {
+            std::int64_t len;
+            read(sock, buffer(&len, 8));
+            std::vector<char> buf(len);
+            read(sock, buffer(buf));
+            std::size_t n = len / one_size;
+            batch_sizes.push_back(n);
+
+            std::string reply;
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                float pos;
+                std::copy(&buf[i * one_size + 38 * board_size], &buf[i * one_size + 38 * board_size] + 4, (char *)&pos);
+                gocnn::ResponseV2 resp;
+                resp.set_board_size(board_size);
+                resp.add_possibility(pos);
+                std::string one = resp.SerializeAsString();
+                if (n == 1)
+                    reply = one;
+                else
+                {
+                    std::int64_t one_len = one.size();
+                    reply.append((const char *)&one_len, 8);
+                    reply += one;
+                }
+            }
+            std::int64_t reply_size = reply.size();
+            write(sock, buffer(&reply_size, 8));
+            write(sock, buffer(reply));
+        }
+    }
+};
+
+TEST(CNNBatchTest, TestBatchCoalescesThreads)
+{
+    const int THREADS = 4;
+    BatchStub stub(7596, 25);
+    std::thread t {&BatchStub::run, &stub, 1};
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    uct::detail::CNNBatchConfig config;
+    config.max_batch_size = THREADS;
+    config.max_wait = std::chrono::seconds(5);
+    config.max_in_flight = 1;
+    uct::detail::CNNBatchBroker broker("127.0.0.1", 7596, config);
+
+    std::vector<float> answers(THREADS);
+    std::vector<std::thread> clients;
+    for (int i=0; i<THREADS; ++i)
+        clients.emplace_back([&, i]() {
+            gocnn::RequestV2 req;
+            req.set_board_size(25);
+            req.mutable_position()->Resize(25, (float) i);
+            answers[i] = broker.sync_call(req).possibility(0);
+        });
+    std::for_each(clients.begin(), clients.end(), [](std::thread &c) { c.join(); });
+    if (t.joinable())
+        t.join();
+
+    ASSERT_EQ(1u, stub.batch_sizes.size());
+    EXPECT_EQ((std::size_t) THREADS, stub.batch_sizes[0]);
+    for (int i=0; i<THREADS; ++i)
+        EXPECT_EQ((float) i, answers[i]);
+    uct::detail::CNNBatchStats stats = broker.getStats();
+    EXPECT_EQ(1u, stats.batch_cnt);
+    EXPECT_EQ(1.0, stats.avg_fill_ratio);
+}
+
 TEST(ReqV1Test, TestReqV1Connect)
 {
     uct::detail::RequestV1Service reqV1Service("127.0.0.1", 7593);
@@ -148,6 +418,332 @@ TEST(ReqV2Test, TestReqV2Connect)
 
 }
 
+TEST(ReqV2Test, TestCompactDecodesPossibilityInPlace)
+{
+    const std::size_t BS = 25;
+    gocnn::ResponseV2 resp;
+    resp.set_board_size(BS);
+    for (std::size_t i=0; i<BS; ++i)
+        resp.add_possibility(i / 100.0f);
+
+    gocnn::RequestV2 reqV2;
+    reqV2.set_board_size(BS);
+    for (std::size_t i=0; i<BS; ++i)
+    {
+        reqV2.add_stone_color_our(i % 2);
+        reqV2.add_position(i * 1.5f);
+    }
+
+    Stub stub(7597, resp.SerializeAsString());
+    std::thread t {&Stub::run, &stub};
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    uct::detail::RequestV2ServiceCompact service("127.0.0.1", 7597);
+    std::vector<float> possibility;
+    service.sync_call(reqV2, possibility);
+    if (t.joinable())
+        t.join();
+
+    EXPECT_EQ(std::vector<float>(resp.possibility().begin(), resp.possibility().end()), possibility);
+    std::string expected(uct::detail::RequestV2ServiceCompact::compact_size(BS), '\0');
+    uct::detail::RequestV2ServiceCompact::encode(reqV2, &expected[0]);
+    EXPECT_EQ(expected, stub.echo); // planes and position gathered into the same frame
+}
+
+TEST(ReqV2Test, TestDecodeUnpackedPossibility)
+{
+    // board_size = 150, then two unpacked possibility values
+    float a = 0.25f, b = 0.75f;
+    std::string wire = "\x08\x96\x01";
+    wire += '\x15';
+    wire.append((const char *)&a, 4);
+    wire += '\x15';
+    wire.append((const char *)&b, 4);
+
+    std::vector<float> possibility {1.0f};
+    uct::detail::RequestV2ServiceCompact::decode_possibility(wire.data(), wire.size(), possibility);
+    ASSERT_EQ(2u, possibility.size());
+    EXPECT_EQ(a, possibility[0]);
+    EXPECT_EQ(b, possibility[1]);
+    EXPECT_THROW(uct::detail::RequestV2ServiceCompact::decode_possibility(wire.data(), wire.size() - 1, possibility),
+                 std::runtime_error);
+}
+
+TEST(BitPlanesTest, TestPackUnpackRoundTrip)
+{
+    for (std::size_t n : {5u, 16u, 81u, 361u})
+    {
+        std::vector<char> bytes(n), unpacked(n);
+        for (std::size_t i=0; i<n; ++i)
+            bytes[i] = (i * 7 % 3) == 0;
+        std::vector<std::uint8_t> packed(uct::detail::packed_plane_size(n));
+        uct::detail::pack_bits(bytes.data(), n, packed.data());
+        EXPECT_EQ(bytes[0], packed[0] & 1);
+        uct::detail::unpack_bits(packed.data(), n, unpacked.data());
+        EXPECT_EQ(bytes, unpacked);
+    }
+}
+
+TEST(ReqV2Test, TestBitPlanesDecodeToCompact)
+{
+    const std::size_t BS = 361;
+    gocnn::ResponseV2 resp;
+    resp.set_board_size(BS);
+    resp.add_possibility(0.5f);
+
+    gocnn::RequestV2 reqV2;
+    reqV2.set_board_size(BS);
+    for (std::size_t i=0; i<BS; ++i)
+    {
+        reqV2.add_stone_color_our(i % 3 == 0);
+        reqV2.add_stone_color_empty(i % 3 != 0);
+        reqV2.add_border(i < 19);
+        reqV2.add_position(i * 0.5f);
+    }
+
+    Stub stub(7598, resp.SerializeAsString());
+    std::thread t {&Stub::run, &stub};
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    uct::detail::RequestV2ServiceCompact service("127.0.0.1", 7598, uct::detail::ConnectionMode::ONE_SHOT,
+                                                 uct::detail::WireFormat::BIT_PLANES);
+    std::vector<float> possibility;
+    service.sync_call(reqV2, possibility);
+    if (t.joinable())
+        t.join();
+
+    using Compact = uct::detail::RequestV2ServiceCompact;
+    ASSERT_EQ(Compact::packed_size(BS), stub.echo.size());
+    EXPECT_GT(Compact::compact_size(BS), 4 * stub.echo.size());
+    ASSERT_TRUE(Compact::is_packed(stub.echo.data(), stub.echo.size()));
+    std::string decoded, expected(Compact::compact_size(BS), '\0');
+    EXPECT_EQ(stub.echo.size(), Compact::decode_packed(stub.echo.data(), stub.echo.size(), decoded));
+    Compact::encode(reqV2, &expected[0]);
+    EXPECT_EQ(expected, decoded);
+    EXPECT_FALSE(Compact::is_packed(expected.data(), expected.size()));
+}
+
+// Accepts one connection and reads the request, then never answers until released
+class SilentStub
+{
+    io_service service;
+    ip::tcp::acceptor acceptor;
+public:
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool released = false;
+
+    SilentStub(unsigned short port):
+            acceptor(service, ip::tcp::endpoint(ip::address::from_string("127.0.0.1"), port))
+    {
+    }
+
+    void run()
+    {
+        ip::tcp::socket sock(service);
+        acceptor.accept(sock);
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this]() { return released; });
+    }
+
+    void release()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        released = true;
+        cv.notify_all();
+    }
+};
+
+TEST(ReqV2Test, TestDeadlineThrowsTimeout)
+{
+    SilentStub stub(7599);
+    std::thread t {&SilentStub::run, &stub};
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    uct::detail::RequestV2ServiceCompact service("127.0.0.1", 7599, uct::detail::ConnectionMode::KEEP_ALIVE);
+    gocnn::RequestV2 reqV2;
+    reqV2.set_board_size(25);
+    std::vector<float> possibility;
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_THROW(service.sync_call(reqV2, possibility, start + std::chrono::milliseconds(100)),
+                 uct::detail::CNNTimeoutError);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+    stub.release();
+    if (t.joinable())
+        t.join();
+
+    uct::detail::CNNLatencyStats stats = service.getLatencyStats();
+    EXPECT_EQ(1u, stats.call_cnt);
+    EXPECT_EQ(1u, stats.timeout_cnt);
+    EXPECT_LE(100.0, stats.max_ms);
+}
+
+TEST(ReqV2Test, TestCancelAllAbortsCallWithoutDeadline)
+{
+    SilentStub stub(7601);
+    std::thread t {&SilentStub::run, &stub};
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    uct::detail::RequestV2ServiceCompact service("127.0.0.1", 7601, uct::detail::ConnectionMode::KEEP_ALIVE);
+    gocnn::RequestV2 reqV2;
+    reqV2.set_board_size(25);
+    std::vector<float> possibility;
+    const auto never = std::chrono::steady_clock::time_point::max();
+
+    std::uint64_t token = service.getCancelCount();
+    service.cancelAll(); // after the token was taken, before the call started: still reaches it
+    EXPECT_THROW(service.sync_call(reqV2, possibility, never, token), uct::detail::CNNTimeoutError);
+
+    std::thread canceller([&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        service.cancelAll();
+    });
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_THROW(service.sync_call(reqV2, possibility, never, service.getCancelCount()),
+                 uct::detail::CNNTimeoutError);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+    canceller.join();
+    stub.release();
+    if (t.joinable())
+        t.join();
+}
+
+TEST(CNNBatchTest, TestDeadlineAndCancelReachWaiters)
+{
+    SilentStub stub(7602);
+    std::thread t {&SilentStub::run, &stub};
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    uct::detail::CNNBatchBroker broker("127.0.0.1", 7602);
+    gocnn::RequestV2 req;
+    req.set_board_size(25);
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_THROW(broker.sync_call(req, start + std::chrono::milliseconds(100), broker.getCancelCount()),
+                 uct::detail::CNNTimeoutError);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+
+    std::thread canceller([&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        broker.cancelAll();
+    });
+    start = std::chrono::steady_clock::now();
+    EXPECT_THROW(broker.sync_call(req, std::chrono::steady_clock::time_point::max(), broker.getCancelCount()),
+                 uct::detail::CNNTimeoutError);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+    canceller.join();
+    stub.release();
+    if (t.joinable())
+        t.join();
+}
+
+class AsyncCNNBase: public uct::detail::CNNServiceBase
+{
+public:
+    using uct::detail::CNNServiceBase::CNNServiceBase;
+};
+
+TEST(CNNBaseTest, TestAsyncCallRunsHandler)
+{
+    Stub stub(7600, "pong");
+    std::thread t {&Stub::run, &stub};
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    AsyncCNNBase cnnbase("127.0.0.1", 7600);
+    const std::string ping = "ping";
+    uct::detail::AlignedBuffer reply;
+    std::promise<std::string> got;
+    std::array<const_buffer, 1> parts {{ buffer(ping) }};
+    cnnbase.async_call(parts, reply, std::chrono::steady_clock::now() + std::chrono::seconds(5),
+                       [&](const boost::system::error_code &ec, std::size_t len) {
+                           got.set_value(ec ? ec.message() : std::string(reply.data(), len));
+                       });
+    auto result = got.get_future();
+    ASSERT_EQ(std::future_status::ready, result.wait_for(std::chrono::seconds(5)));
+    EXPECT_EQ("pong", result.get());
+    if (t.joinable())
+        t.join();
+    EXPECT_EQ("ping", stub.echo);
+    EXPECT_EQ(1u, cnnbase.getLatencyStats().call_cnt);
+}
+
+// Direct (non-im2col) evaluation of a conv stack over planes[c][x * h + y], soft-maxed
+static std::vector<float> referenceForward(const std::vector<uct::detail::ConvLayer> &layers, std::size_t w,
+                                           std::size_t h, std::vector<float> planes)
+{
+    for (const auto &l: layers)
+    {
+        std::vector<float> out(l.out_channels * w * h);
+        const long pad = l.kernel / 2;
+        for (std::size_t o=0; o<l.out_channels; ++o)
+            for (long x=0; x<(long) w; ++x)
+                for (long y=0; y<(long) h; ++y)
+                {
+                    float acc = l.bias[o];
+                    for (std::size_t c=0; c<l.in_channels; ++c)
+                        for (long dx=0; dx<(long) l.kernel; ++dx)
+                            for (long dy=0; dy<(long) l.kernel; ++dy)
+                            {
+                                long sx = x + dx - pad, sy = y + dy - pad;
+                                if (sx >= 0 && sx < (long) w && sy >= 0 && sy < (long) h)
+                                    acc += l.weights[((o * l.in_channels + c) * l.kernel + dx) * l.kernel + dy] *
+                                           planes[c * w * h + sx * h + sy];
+                            }
+                    out[o * w * h + x * h + y] = l.relu ? std::max(acc, 0.0f) : acc;
+                }
+        planes = out;
+    }
+    float top = *std::max_element(planes.begin(), planes.end()), sum = 0.0f;
+    for (float &p: planes)
+        sum += p = std::exp(p - top);
+    for (float &p: planes)
+        p /= sum;
+    return planes;
+}
+
+TEST(ConvEvaluatorTest, TestMatchesDirectConvolution)
+{
+    const std::size_t W = 5, H = 7, N = W * H;
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<float> dist(-0.5f, 0.5f);
+    auto make_layer = [&](std::uint32_t in, std::uint32_t out, std::uint32_t k, bool relu) {
+        uct::detail::ConvLayer l {in, out, k, relu, std::vector<float>(out * in * k * k), std::vector<float>(out)};
+        std::generate(l.weights.begin(), l.weights.end(), [&]() { return dist(gen); });
+        std::generate(l.bias.begin(), l.bias.end(), [&]() { return dist(gen); });
+        return l;
+    };
+    std::vector<uct::detail::ConvLayer> layers {make_layer(39, 6, 3, true), make_layer(6, 4, 5, true),
+                                                make_layer(4, 1, 1, false)};
+    const std::string file = "conv_evaluator_test.weights";
+    uct::detail::ConvPolicyEvaluator(W, H, layers).save(file);
+    uct::detail::ConvPolicyEvaluator evaluator(file);
+    std::remove(file.c_str());
+    EXPECT_EQ(W, evaluator.getWidth());
+    EXPECT_EQ(H, evaluator.getHeight());
+
+    gocnn::RequestV2 req;
+    req.set_board_size(N);
+    std::vector<float> planes(39 * N, 0.0f);
+    for (std::size_t i=0; i<N; ++i)
+    {
+        req.add_stone_color_our(i % 3 == 0);
+        req.add_stone_color_oppo(i % 3 == 1);
+        req.add_stone_color_empty(i % 3 == 2);
+        req.add_position(dist(gen));
+        planes[i % 3 * N + i] = 1.0f;
+        planes[38 * N + i] = req.position(i);
+    }
+    std::vector<float> possibility;
+    evaluator.evaluate(req, possibility, std::chrono::steady_clock::time_point::max(), 0);
+    std::vector<float> expected = referenceForward(layers, W, H, planes);
+    ASSERT_EQ(N, possibility.size());
+    for (std::size_t i=0; i<N; ++i)
+        EXPECT_NEAR(expected[i], possibility[i], 1e-5);
+    EXPECT_EQ(1u, evaluator.getLatencyStats().call_cnt);
+
+    req.set_board_size(N + 1);
+    EXPECT_THROW(evaluator.evaluate(req, possibility, std::chrono::steady_clock::time_point::max(), 0),
+                 std::invalid_argument);
+    EXPECT_THROW(uct::detail::ConvPolicyEvaluator("no_such_file.weights"), std::runtime_error);
+}
+
 TEST(ReqV1Test, DISABLED_TestReqV1Remote)
 {
     uct::detail::RequestV1Service reqV1Service("127.0.0.1", 7591);
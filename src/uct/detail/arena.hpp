@@ -0,0 +1,470 @@
+//
+// Created by lz on 1/12/17.
+//
+
+#ifndef LIBUCT_ARENA_HPP
+#define LIBUCT_ARENA_HPP
+
+#include <atomic>
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace uct
+{
+    namespace detail
+    {
+        // Per-tree bump allocator. Every thread carves allocations out of its own slab, so allocating is a pointer
+        // bump without any lock; slabs are only handed out under the mutex. Memory is released all at once when the
+        // arena dies. Blocks given back through deallocate() are recycled for allocations of the same size.
+        class NodeArena
+        {
+        public:
+            static const std::size_t SLAB_SIZE = 256 * 1024;
+            static const std::size_t ALIGN = 64; // allocations start on a cache line
+
+        private:
+            struct ThreadCache
+            {
+                std::uint64_t arena_id;
+                char *cur;
+                char *end;
+            };
+            static const std::size_t CACHE_WAYS = 4; // a thread may work on a few trees at once
+
+            static ThreadCache *thread_caches()
+            {
+                static thread_local ThreadCache caches[CACHE_WAYS] = {};
+                return caches;
+            }
+
+            static std::uint64_t next_id()
+            {
+                static std::atomic<std::uint64_t> id {1};
+                return id.fetch_add(1);
+            }
+
+            const std::uint64_t id = next_id(); // never reused, so stale thread caches can't match a new arena
+            std::mutex mutex;
+            std::vector<void *> slabs; // guarded by mutex
+            std::unordered_map<std::size_t, std::vector<void *>> free_blocks; // guarded by mutex, by rounded size
+            std::atomic<std::size_t> free_cnt {0};
+            std::atomic<std::size_t> reserved_bytes {0};
+            std::atomic<std::size_t> used_bytes {0};
+            std::atomic<std::ptrdiff_t> node_cnt {0};
+
+            static std::size_t round_up(std::size_t bytes)
+            {
+                return (bytes + ALIGN - 1) / ALIGN * ALIGN;
+            }
+
+            char *new_slab(std::size_t bytes)
+            {
+                void *raw = ::operator new(bytes + ALIGN);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    slabs.push_back(raw);
+                }
+                reserved_bytes.fetch_add(bytes + ALIGN);
+                std::uintptr_t p = reinterpret_cast<std::uintptr_t>(raw);
+                return reinterpret_cast<char *>((p + ALIGN - 1) / ALIGN * ALIGN);
+            }
+
+            void *reuse(std::size_t bytes)
+            {
+                if (!free_cnt.load(std::memory_order_relaxed))
+                    return nullptr;
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it = free_blocks.find(bytes);
+                if (it == free_blocks.end() || it->second.empty())
+                    return nullptr;
+                void *p = it->second.back();
+                it->second.pop_back();
+                free_cnt.fetch_sub(1);
+                return p;
+            }
+
+        public:
+            NodeArena() = default;
+            NodeArena(const NodeArena &) = delete;
+            NodeArena& operator=(const NodeArena &) = delete;
+
+            ~NodeArena()
+            {
+                for (void *slab: slabs)
+                    ::operator delete(slab);
+            }
+
+            void *allocate(std::size_t bytes)
+            {
+                bytes = round_up(bytes);
+                used_bytes.fetch_add(bytes, std::memory_order_relaxed);
+                if (void *p = reuse(bytes))
+                    return p;
+                if (bytes > SLAB_SIZE / 4)
+                    return new_slab(bytes);
+
+                ThreadCache *caches = thread_caches();
+                ThreadCache *cache = nullptr;
+                for (std::size_t i=0; i<CACHE_WAYS && !cache; ++i)
+                    if (caches[i].arena_id == id)
+                        cache = &caches[i];
+                if (!cache || cache->cur + bytes > cache->end)
+                {
+                    if (!cache)
+                    {
+                        // evict the least recently claimed way
+                        static thread_local std::size_t victim = 0;
+                        cache = &caches[victim++ % CACHE_WAYS];
+                    }
+                    cache->arena_id = id;
+                    cache->cur = new_slab(SLAB_SIZE);
+                    cache->end = cache->cur + SLAB_SIZE;
+                }
+                void *p = cache->cur;
+                cache->cur += bytes;
+                return p;
+            }
+
+            // Hand a block back for reuse by a later allocate() of the same size; its memory is only returned to
+            // the system with the arena
+            void deallocate(void *p, std::size_t bytes)
+            {
+                bytes = round_up(bytes);
+                used_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+                std::lock_guard<std::mutex> lock(mutex);
+                free_blocks[bytes].push_back(p);
+                free_cnt.fetch_add(1);
+            }
+
+            // Bytes taken from the system
+            std::size_t getReservedBytes() const
+            {
+                return reserved_bytes.load();
+            }
+
+            // Bytes currently handed out
+            std::size_t getUsedBytes() const
+            {
+                return used_bytes.load();
+            }
+
+            // Track the nodes constructed in (positive n) or destroyed with (negative n) ranges of this arena
+            void addNodes(std::ptrdiff_t n)
+            {
+                node_cnt.fetch_add(n, std::memory_order_relaxed);
+            }
+
+            // Nodes living in ranges of this arena
+            std::size_t getNodeCount() const
+            {
+                return (std::size_t) std::max<std::ptrdiff_t>(0, node_cnt.load(std::memory_order_relaxed));
+            }
+        };
+
+        // Children of one node, in ranges ("chunks") carved from a NodeArena as the node expands, so leaves cost
+        // no allocation at all. Each reserve() that needs more slots links one chunk, at least as large as all the
+        // chunks before it, so a node reserving its capacity at once gets a single contiguous range and one that
+        // grows slot by slot needs O(log capacity) chunks and at most twice the slots it asked for (or MIN_CHUNK).
+        // Addresses are stable: chunks never move. Destroying the array destroys the children but leaves their
+        // memory to the arena.
+        //
+        // Next to its nodes a chunk holds one EdgeT per slot (unless EdgeT is empty): small per-child records
+        // packed back to back, so that scanning the children's statistics reads a few cache lines instead of
+        // every child node. Edges must be trivially destructible; they are value-initialized when their chunk is
+        // reserved.
+        //
+        // Expansion is lock-free: a thread claims the next index, constructs the child there and publishes it with
+        // a release store of the size, in index order. Readers see children [0, size()) fully built through an
+        // acquire load and never need a lock. Child constructors must not throw.
+        template<typename NodeT, typename EdgeT>
+        class ChildArray
+        {
+            static_assert(std::is_trivially_destructible<EdgeT>::value, "edges are never destroyed");
+            static const std::size_t MIN_CHUNK = 4; // slots, unless the capacity is smaller
+
+            // Slots [first, first + size), laid out as this header, the nodes and the edges, each cache-line aligned
+            struct Chunk
+            {
+                std::atomic<Chunk *> next {nullptr};
+                std::uint32_t first;
+                std::uint32_t size;
+
+                static std::size_t header_bytes()
+                {
+                    return (sizeof(Chunk) + NodeArena::ALIGN - 1) / NodeArena::ALIGN * NodeArena::ALIGN;
+                }
+
+                static std::size_t node_bytes(std::size_t size)
+                {
+                    return (size * sizeof(NodeT) + NodeArena::ALIGN - 1) / NodeArena::ALIGN * NodeArena::ALIGN;
+                }
+
+                static std::size_t bytes(std::size_t size)
+                {
+                    return header_bytes() + node_bytes(size) + (std::is_empty<EdgeT>::value ? 0 : size * sizeof(EdgeT));
+                }
+
+                NodeT *nodes()
+                {
+                    return reinterpret_cast<NodeT *>(reinterpret_cast<char *>(this) + header_bytes());
+                }
+
+                EdgeT *edges()
+                {
+                    return reinterpret_cast<EdgeT *>(reinterpret_cast<char *>(nodes()) + node_bytes(size));
+                }
+
+                bool holds(std::size_t i) const
+                {
+                    return i - first < size;
+                }
+            };
+
+            std::atomic<Chunk *> head_ {nullptr};
+            std::atomic<std::uint32_t> size_ {0}; // children [0, size_) are constructed and visible
+            std::atomic<std::uint32_t> claimed_ {0}; // indices handed out so far
+            std::atomic<std::uint32_t> reserved_ {0}; // slots in linked chunks
+            std::atomic<std::uint32_t> capacity_ {0};
+
+            // Chunk holding slot i, which must be reserved
+            Chunk *chunk_of(std::size_t i) const
+            {
+                Chunk *c = head_.load(std::memory_order_acquire);
+                while (!c->holds(i))
+                    c = c->next.load(std::memory_order_acquire);
+                return c;
+            }
+
+            void destroy_all()
+            {
+                std::uint32_t n = size_.load(std::memory_order_relaxed);
+                for (Chunk *c = head_.load(std::memory_order_relaxed); c && c->first < n;
+                     c = c->next.load(std::memory_order_relaxed))
+                    for (std::uint32_t i = c->first; i < n && c->holds(i); ++i)
+                        c->nodes()[i - c->first].~NodeT();
+                size_.store(0, std::memory_order_relaxed);
+                claimed_.store(0, std::memory_order_relaxed);
+            }
+
+            template<typename ChunkT, typename N>
+            class Iterator
+            {
+                ChunkT *chunk_;
+                std::size_t i_;
+            public:
+                using iterator_category = std::forward_iterator_tag;
+                using value_type = NodeT;
+                using difference_type = std::ptrdiff_t;
+                using pointer = N *;
+                using reference = N &;
+
+                Iterator(ChunkT *chunk, std::size_t i): chunk_(chunk), i_(i) {}
+
+                N &operator*() const { return chunk_->nodes()[i_ - chunk_->first]; }
+                N *operator->() const { return &**this; }
+
+                Iterator &operator++()
+                {
+                    if (!chunk_->holds(++i_))
+                        chunk_ = chunk_->next.load(std::memory_order_acquire);
+                    return *this;
+                }
+
+                Iterator operator++(int)
+                {
+                    Iterator old = *this;
+                    ++*this;
+                    return old;
+                }
+
+                // Index distance, e.g. of an element found by a std algorithm from begin()
+                std::ptrdiff_t operator-(const Iterator &other) const
+                {
+                    return (std::ptrdiff_t) i_ - (std::ptrdiff_t) other.i_;
+                }
+
+                bool operator==(const Iterator &other) const { return i_ == other.i_; }
+                bool operator!=(const Iterator &other) const { return i_ != other.i_; }
+            };
+        public:
+            using iterator = Iterator<Chunk, NodeT>;
+            using const_iterator = Iterator<Chunk, const NodeT>;
+
+            ChildArray() = default;
+
+            // Only empty arrays may be copied (e.g. a root node handed out by value)
+            ChildArray(const ChildArray &other)
+            {
+                assert(other.empty());
+                (void) other;
+            }
+
+            // Not thread-safe: other must not be expanded concurrently
+            ChildArray(ChildArray &&other):
+                    head_(other.head_.load()), size_(other.size_.load()), claimed_(other.claimed_.load()),
+                    reserved_(other.reserved_.load()), capacity_(other.capacity_.load())
+            {
+                other.head_.store(nullptr);
+                other.size_.store(0);
+                other.claimed_.store(0);
+                other.reserved_.store(0);
+                other.capacity_.store(0);
+            }
+
+            ChildArray& operator=(const ChildArray &) = delete;
+
+            ~ChildArray()
+            {
+                destroy_all();
+            }
+
+            // Make sure slots [0, min(n, capacity)) exist. Racing threads may each allocate a chunk, but only one
+            // is linked; every caller must pass the same capacity.
+            void reserve(NodeArena &arena, std::size_t capacity, std::size_t n)
+            {
+                capacity_.store(static_cast<std::uint32_t>(capacity), std::memory_order_relaxed);
+                n = std::min(n, capacity);
+                std::atomic<Chunk *> *link = &head_;
+                std::size_t covered = 0;
+                for (;;)
+                {
+                    Chunk *c = link->load(std::memory_order_acquire);
+                    if (c)
+                    {
+                        covered = c->first + c->size;
+                        link = &c->next;
+                        continue;
+                    }
+                    if (covered >= n)
+                    {
+                        // whoever linked the last chunk may not have counted it yet
+                        std::uint32_t r = reserved_.load(std::memory_order_relaxed);
+                        while (r < covered &&
+                               !reserved_.compare_exchange_weak(r, static_cast<std::uint32_t>(covered),
+                                                                std::memory_order_relaxed))
+                            ;
+                        return;
+                    }
+                    std::size_t size = std::min(capacity - covered, std::max({n - covered, covered, MIN_CHUNK}));
+                    Chunk *chunk = new (arena.allocate(Chunk::bytes(size))) Chunk();
+                    chunk->first = static_cast<std::uint32_t>(covered);
+                    chunk->size = static_cast<std::uint32_t>(size);
+                    if (!std::is_empty<EdgeT>::value)
+                        for (std::size_t i=0; i<size; ++i)
+                            new (chunk->edges() + i) EdgeT();
+                    if (!link->compare_exchange_strong(c, chunk, std::memory_order_release))
+                        arena.deallocate(chunk, Chunk::bytes(size)); // lost the race; go on from the winner's
+                }
+            }
+
+            // Take the next free index if it is below limit and reserved
+            bool claim(std::size_t limit, std::size_t &index)
+            {
+                limit = std::min<std::size_t>(limit, reserved_.load(std::memory_order_relaxed));
+                std::uint32_t c = claimed_.load(std::memory_order_relaxed);
+                do
+                {
+                    if (c >= limit)
+                        return false;
+                } while (!claimed_.compare_exchange_weak(c, c + 1, std::memory_order_relaxed));
+                index = c;
+                return true;
+            }
+
+            // Construct the child at a claimed index; it stays invisible to readers until publish(index)
+            template<typename ... Us>
+            NodeT &construct(std::size_t index, Us&& ...us)
+            {
+                Chunk *c = chunk_of(index);
+                return *new (c->nodes() + (index - c->first)) NodeT(std::forward<Us>(us)...);
+            }
+
+            // Make a constructed child visible, once every earlier index has been published
+            NodeT &publish(std::size_t index)
+            {
+                while (size_.load(std::memory_order_acquire) != index)
+                    std::this_thread::yield(); // an earlier claimer is still constructing
+                size_.store(static_cast<std::uint32_t>(index + 1), std::memory_order_release);
+                return (*this)[index];
+            }
+
+            // Destroy all children and give the chunks back to the arena. Not thread-safe.
+            void release(NodeArena &arena)
+            {
+                Chunk *c = head_.load();
+                if (!c)
+                    return;
+                arena.addNodes(-(std::ptrdiff_t) size_.load());
+                destroy_all();
+                while (c)
+                {
+                    Chunk *next = c->next.load();
+                    std::size_t size = c->size;
+                    c->~Chunk();
+                    arena.deallocate(c, Chunk::bytes(size));
+                    c = next;
+                }
+                head_.store(nullptr);
+                reserved_.store(0);
+                capacity_.store(0);
+            }
+
+            std::size_t size() const { return size_.load(std::memory_order_acquire); }
+            std::size_t capacity() const { return capacity_.load(std::memory_order_relaxed); }
+            std::size_t reserved() const { return reserved_.load(std::memory_order_relaxed); }
+            bool empty() const { return size() == 0; }
+
+            NodeT &operator[](std::size_t i)
+            {
+                Chunk *c = chunk_of(i);
+                return c->nodes()[i - c->first];
+            }
+            const NodeT &operator[](std::size_t i) const
+            {
+                return const_cast<ChildArray &>(*this)[i];
+            }
+            NodeT &back() { return (*this)[size() - 1]; }
+
+            // Edge of slot i, which must be reserved; EdgeT must not be empty
+            EdgeT &edge(std::size_t i)
+            {
+                Chunk *c = chunk_of(i);
+                return c->edges()[i - c->first];
+            }
+            const EdgeT &edge(std::size_t i) const
+            {
+                return const_cast<ChildArray *>(this)->edge(i);
+            }
+
+            // Call f(edges, first, cnt) for the edges of slots [0, n), one contiguous run per chunk, in order
+            template<typename F>
+            void edge_ranges(std::size_t n, F f) const
+            {
+                for (Chunk *c = head_.load(std::memory_order_acquire); c && c->first < n;
+                     c = c->next.load(std::memory_order_acquire))
+                    f(const_cast<const EdgeT *>(c->edges()), (std::size_t) c->first,
+                      std::min<std::size_t>(c->size, n - c->first));
+            }
+
+            iterator begin() { return iterator(head_.load(std::memory_order_acquire), 0); }
+            iterator end() { return iterator(nullptr, size()); }
+            const_iterator begin() const { return const_iterator(head_.load(std::memory_order_acquire), 0); }
+            const_iterator end() const { return const_iterator(nullptr, size()); }
+            const_iterator cbegin() const { return begin(); }
+            const_iterator cend() const { return end(); }
+        };
+    }
+}
+
+#endif //LIBUCT_ARENA_HPP
@@ -0,0 +1,68 @@
+//
+// Created by lz on 1/19/17.
+//
+
+#ifndef LIBUCT_BITPLANES_HPP
+#define LIBUCT_BITPLANES_HPP
+
+#include <cstddef>
+#include <cstdint>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace uct
+{
+    namespace detail
+    {
+        // Bytes taken by n bit-packed points
+        inline std::size_t packed_plane_size(std::size_t n)
+        {
+            return (n + 7) / 8;
+        }
+
+        // Pack n byte flags (non-zero: set) into packed_plane_size(n) bytes; point i is bit i % 8 of byte i / 8
+        inline void pack_bits(const char *bytes, std::size_t n, std::uint8_t *out)
+        {
+            std::size_t i = 0;
+#ifdef __SSE2__
+            const __m128i zero = _mm_setzero_si128();
+            for (; i + 16 <= n; i += 16)
+            {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i));
+                unsigned mask = ~static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero))) & 0xffff;
+                out[i / 8] = static_cast<std::uint8_t>(mask);
+                out[i / 8 + 1] = static_cast<std::uint8_t>(mask >> 8);
+            }
+#endif
+            for (; i < n; i += 8)
+            {
+                std::uint8_t b = 0;
+                for (std::size_t j = 0; j < 8 && i + j < n; ++j)
+                    b |= (bytes[i + j] ? 1 : 0) << j;
+                out[i / 8] = b;
+            }
+        }
+
+        // Inverse of pack_bits: expand packed_plane_size(n) bytes into n bytes of 0/1
+        inline void unpack_bits(const std::uint8_t *packed, std::size_t n, char *bytes)
+        {
+            std::size_t i = 0;
+#ifdef __SSE2__
+            const __m128i select = _mm_set_epi8(-128, 64, 32, 16, 8, 4, 2, 1, -128, 64, 32, 16, 8, 4, 2, 1);
+            const __m128i one = _mm_set1_epi8(1);
+            for (; i + 16 <= n; i += 16)
+            {
+                __m128i v = _mm_set_epi64x(0x0101010101010101LL * packed[i / 8 + 1],
+                                           0x0101010101010101LL * packed[i / 8]);
+                v = _mm_cmpeq_epi8(_mm_and_si128(v, select), select);
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(bytes + i), _mm_and_si128(v, one));
+            }
+#endif
+            for (; i < n; ++i)
+                bytes[i] = (packed[i / 8] >> (i % 8)) & 1;
+        }
+    }
+}
+
+#endif //LIBUCT_BITPLANES_HPP
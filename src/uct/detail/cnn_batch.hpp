@@ -0,0 +1,273 @@
+//
+// Created by lz on 1/9/17.
+//
+
+#ifndef LIBUCT_CNN_BATCH_HPP
+#define LIBUCT_CNN_BATCH_HPP
+
+#include "cnn_v1.hpp"
+#include "logger.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <exception>
+
+namespace uct
+{
+    namespace detail
+    {
+        struct CNNBatchConfig
+        {
+            std::size_t max_batch_size = 16; // a batch is shipped as soon as it holds this many requests
+            std::chrono::microseconds max_wait {2000}; // ... or when its oldest request has waited this long
+            std::size_t max_in_flight = 2; // batched RPCs outstanding at the same time
+        };
+
+        struct CNNBatchStats
+        {
+            std::size_t batch_cnt = 0;
+            std::size_t request_cnt = 0;
+            double avg_latency_ms = 0.0; // from the oldest request being queued to its batch being answered
+            double max_latency_ms = 0.0;
+            double avg_fill_ratio = 0.0; // request_cnt / (batch_cnt * max_batch_size)
+        };
+
+        // Collects RequestV2s from many search threads and ships them to the CNN server as batched compact
+        // requests. Each caller blocks in sync_call until its slice of the batched response is back, its deadline
+        // passes or cancelAll is called. A caller that gives up leaves its request behind: queued requests are
+        // dropped, batches already sent are answered into the void.
+        class CNNBatchBroker
+        {
+            using Clock = std::chrono::steady_clock;
+
+            struct PendingRequest
+            {
+                std::string frame; // encoded by the caller, so the request needn't outlive its sync_call
+                Clock::time_point deadline;
+                Clock::time_point enqueue_time;
+                bool done = false; // guarded by queue_mutex, like resp and error
+                gocnn::ResponseV2 resp;
+                std::exception_ptr error;
+            };
+            using PendingPtr = std::shared_ptr<PendingRequest>;
+
+            std::shared_ptr<spdlog::logger> logger = getGlobalLogger();
+            const CNNBatchConfig config;
+            RequestV2ServiceCompact service;
+
+            std::mutex queue_mutex;
+            std::condition_variable queue_cv;
+            std::condition_variable done_cv; // a batch was answered, or cancelAll
+            std::deque<PendingPtr> queue; // guarded by queue_mutex
+            bool stopping = false; // guarded by queue_mutex
+            std::uint64_t cancel_cnt = 0; // guarded by queue_mutex
+            std::vector<std::thread> senders;
+
+            std::atomic<std::size_t> batch_cnt {0};
+            std::atomic<std::size_t> request_cnt {0};
+            std::atomic<long long> latency_us_sum {0};
+            std::atomic<long long> latency_us_max {0};
+
+            // Send batch, which waits for the latest deadline among its requests; cancel_token is the service's,
+            // taken when the batch left the queue
+            void send_batch(std::vector<PendingPtr> &batch, std::uint64_t cancel_token)
+            {
+                std::vector<std::string> frames;
+                frames.reserve(batch.size());
+                Clock::time_point deadline = Clock::time_point::min();
+                for (PendingPtr &p: batch)
+                {
+                    frames.push_back(std::move(p->frame));
+                    deadline = std::max(deadline, p->deadline);
+                }
+                std::vector<gocnn::ResponseV2> resps;
+                std::exception_ptr error;
+                try
+                {
+                    resps = service.batch_sync_call(frames, deadline, cancel_token);
+                    auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+                            Clock::now() - batch.front()->enqueue_time).count();
+                    record(batch.size(), latency);
+                } catch (...)
+                {
+                    error = std::current_exception();
+                }
+                {
+                    std::lock_guard<std::mutex> lock(queue_mutex);
+                    for (std::size_t i=0; i<batch.size(); ++i)
+                    {
+                        batch[i]->done = true;
+                        if (error)
+                            batch[i]->error = error;
+                        else
+                            batch[i]->resp = std::move(resps[i]);
+                    }
+                }
+                done_cv.notify_all();
+            }
+
+            void record(std::size_t size, long long latency_us)
+            {
+                batch_cnt.fetch_add(1);
+                request_cnt.fetch_add(size);
+                latency_us_sum.fetch_add(latency_us);
+                long long prev_max = latency_us_max.load();
+                while (prev_max < latency_us && !latency_us_max.compare_exchange_weak(prev_max, latency_us));
+                logger->trace("CNN batch of {} sent, fill={}, latency={}us", size,
+                              (double) size / config.max_batch_size, latency_us);
+            }
+
+            void sender_loop()
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                for (;;)
+                {
+                    queue_cv.wait(lock, [this]() { return stopping || !queue.empty(); });
+                    if (queue.empty())
+                        return; // stopping and drained
+
+                    auto deadline = queue.front()->enqueue_time + config.max_wait;
+                    while (!stopping && queue.size() < config.max_batch_size &&
+                           std::chrono::steady_clock::now() < deadline)
+                        queue_cv.wait_until(lock, deadline);
+                    if (queue.empty())
+                        continue; // taken by another sender meanwhile
+
+                    std::size_t n = std::min(queue.size(), config.max_batch_size);
+                    std::vector<PendingPtr> batch(queue.begin(), queue.begin() + n);
+                    queue.erase(queue.begin(), queue.begin() + n);
+                    std::uint64_t cancel_token = service.getCancelCount(); // cancelAll bumps it under queue_mutex
+
+                    lock.unlock();
+                    send_batch(batch, cancel_token);
+                    lock.lock();
+                }
+            }
+        public:
+            CNNBatchBroker(const std::string &addr, unsigned short port, const CNNBatchConfig &config = CNNBatchConfig(),
+                           ConnectionMode mode = ConnectionMode::KEEP_ALIVE,
+                           WireFormat format = WireFormat::BYTE_PLANES,
+                           const FrameConfig &frame_config = FrameConfig()):
+                    config(config), service(addr, port, mode, format, frame_config)
+            {
+                assert(config.max_batch_size > 0 && config.max_in_flight > 0);
+                for (std::size_t i=0; i<config.max_in_flight; ++i)
+                    senders.emplace_back(&CNNBatchBroker::sender_loop, this);
+            }
+
+            CNNBatchBroker(const CNNBatchBroker &) = delete;
+            CNNBatchBroker& operator=(const CNNBatchBroker &) = delete;
+
+            ~CNNBatchBroker()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(queue_mutex);
+                    stopping = true;
+                }
+                queue_cv.notify_all();
+                std::for_each(senders.begin(), senders.end(), [](std::thread &t) {
+                    if (t.joinable())
+                        t.join();
+                });
+                CNNBatchStats stats = getStats();
+                logger->debug("CNN batch broker finished: {} batches, {} requests, fill={}, avg latency={}ms, max={}ms",
+                              stats.batch_cnt, stats.request_cnt, stats.avg_fill_ratio,
+                              stats.avg_latency_ms, stats.max_latency_ms);
+            }
+
+            // Same contract as RequestV2ServiceCompact::sync_call; may be called from any number of threads.
+            // Throws CNNTimeoutError once deadline has passed, or on a cancelAll after cancel_token was taken
+            // (getCancelCount()), even one that came before this call.
+            gocnn::ResponseV2 sync_call(const gocnn::RequestV2 &reqV2, Clock::time_point deadline,
+                                        std::uint64_t cancel_token)
+            {
+                PendingPtr pending = std::make_shared<PendingRequest>();
+                pending->frame = service.encode_request(reqV2);
+                pending->deadline = deadline;
+                pending->enqueue_time = Clock::now();
+                bool full;
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                if (cancel_cnt != cancel_token)
+                    throw CNNTimeoutError("CNN call cancelled");
+                queue.push_back(pending);
+                full = queue.size() >= config.max_batch_size;
+                lock.unlock();
+                if (full)
+                    queue_cv.notify_all();
+                else
+                    queue_cv.notify_one();
+
+                lock.lock();
+                auto answered = [&]() { return pending->done || cancel_cnt != cancel_token; };
+                if (deadline == Clock::time_point::max())
+                    done_cv.wait(lock, answered);
+                else
+                    done_cv.wait_until(lock, deadline, answered);
+                if (!pending->done)
+                {
+                    auto it = std::find(queue.begin(), queue.end(), pending);
+                    if (it != queue.end())
+                        queue.erase(it);
+                    throw CNNTimeoutError(cancel_cnt != cancel_token ? "CNN call cancelled" :
+                                          "CNN call missed its deadline");
+                }
+                if (pending->error)
+                    std::rethrow_exception(pending->error);
+                return std::move(pending->resp);
+            }
+
+            gocnn::ResponseV2 sync_call(const gocnn::RequestV2 &reqV2)
+            {
+                return sync_call(reqV2, Clock::time_point::max(), getCancelCount());
+            }
+
+            // Wake every caller waiting in sync_call with a timeout, and abort the batches on the wire
+            void cancelAll()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(queue_mutex);
+                    ++cancel_cnt;
+                    service.cancelAll();
+                }
+                done_cv.notify_all();
+            }
+
+            // Calls to cancelAll so far, the cancel token of a call starting now
+            std::uint64_t getCancelCount()
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                return cancel_cnt;
+            }
+
+            CNNBatchStats getStats() const
+            {
+                CNNBatchStats stats;
+                stats.batch_cnt = batch_cnt.load();
+                stats.request_cnt = request_cnt.load();
+                if (stats.batch_cnt)
+                {
+                    stats.avg_latency_ms = latency_us_sum.load() / 1000.0 / stats.batch_cnt;
+                    stats.avg_fill_ratio = (double) stats.request_cnt / (stats.batch_cnt * config.max_batch_size);
+                }
+                stats.max_latency_ms = latency_us_max.load() / 1000.0;
+                return stats;
+            }
+
+            const CNNBatchConfig &getConfig() const
+            {
+                return config;
+            }
+        };
+    }
+}
+
+#endif //LIBUCT_CNN_BATCH_HPP
@@ -0,0 +1,158 @@
+//
+// Created by lz on 1/18/17.
+//
+
+#ifndef LIBUCT_CNN_CACHE_HPP
+#define LIBUCT_CNN_CACHE_HPP
+
+#include "zobrist.hpp"
+#include "message.pb.h"
+#include <board.hpp>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace uct
+{
+    namespace detail
+    {
+        struct CNNCacheStats
+        {
+            std::size_t hit_cnt = 0;
+            std::size_t miss_cnt = 0;
+            std::size_t entry_cnt = 0;
+            std::size_t bytes = 0; // probability payload currently held
+        };
+
+        // Bounded LRU cache of CNN move probabilities, keyed by the hash of the position and its recent moves. With
+        // symmetries enabled a position is stored once for all its rotations/reflections (8 on square boards, 4
+        // otherwise) and probabilities are mapped back to the orientation of the board that asked. Sharded so that
+        // threads rarely share a lock.
+        template<std::size_t W, std::size_t H>
+        class CNNResponseCache
+        {
+            static const std::size_t SHARDS = 16;
+            static const std::size_t SYMMETRY_CNT = W == H ? 8 : 4;
+
+            struct Shard
+            {
+                using ListType = std::list<std::pair<std::uint64_t, std::vector<float>>>; // front: most recent
+                std::mutex mutex;
+                ListType lru;
+                std::unordered_map<std::uint64_t, typename ListType::iterator> index;
+            };
+
+            const std::size_t max_entries_per_shard;
+            const bool use_symmetries;
+            Shard shards[SHARDS];
+
+            std::atomic<std::size_t> hit_cnt {0};
+            std::atomic<std::size_t> miss_cnt {0};
+            std::atomic<std::size_t> entry_cnt {0};
+            std::atomic<std::size_t> bytes {0};
+
+            // Point that index i is sent to by symmetry t (i = x * H + y)
+            static std::size_t transform(std::size_t t, std::size_t i)
+            {
+                std::size_t x = i / H, y = i % H;
+                if (t & 4) // transpose, only offered on square boards
+                    std::swap(x, y);
+                if (t & 1)
+                    x = W - 1 - x;
+                if (t & 2)
+                    y = H - 1 - y;
+                return x * H + y;
+            }
+
+            // Canonical key of req: the smallest hash over all symmetries, and the symmetry that produced it
+            std::pair<std::uint64_t, std::size_t> canonical(const gocnn::RequestV2 &req, board::Player to_move) const
+            {
+                const Zobrist<W, H> &z = Zobrist<W, H>::instance();
+                std::pair<std::uint64_t, std::size_t> best(z.hashRequest(req, to_move, true), 0);
+                if (use_symmetries)
+                    for (std::size_t t=1; t<SYMMETRY_CNT; ++t)
+                    {
+                        std::uint64_t h = z.hashRequest(req, to_move, [t](std::size_t i) { return transform(t, i); },
+                                                        true);
+                        if (h < best.first)
+                            best = std::make_pair(h, t);
+                    }
+                return best;
+            }
+
+            Shard &shard(std::uint64_t key)
+            {
+                return shards[(key >> 7) % SHARDS];
+            }
+        public:
+            CNNResponseCache(std::size_t max_entries, bool use_symmetries):
+                    max_entries_per_shard((max_entries + SHARDS - 1) / SHARDS), use_symmetries(use_symmetries)
+            {}
+
+            // On a hit, fill probs (W * H, in req's orientation) and return true
+            bool lookup(const gocnn::RequestV2 &req, board::Player to_move, std::vector<float> &probs)
+            {
+                auto key = canonical(req, to_move);
+                Shard &s = shard(key.first);
+                std::lock_guard<std::mutex> lock(s.mutex);
+                auto it = s.index.find(key.first);
+                if (it == s.index.end())
+                {
+                    miss_cnt.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                s.lru.splice(s.lru.begin(), s.lru, it->second);
+                const std::vector<float> &stored = it->second->second;
+                probs.resize(W * H);
+                for (std::size_t i=0; i<W * H; ++i)
+                    probs[i] = stored[transform(key.second, i)];
+                hit_cnt.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+
+            // Remember probs (W * H, in req's orientation) for req's position
+            void store(const gocnn::RequestV2 &req, board::Player to_move, const float *probs, std::size_t n)
+            {
+                if (n != W * H || !max_entries_per_shard)
+                    return;
+                auto key = canonical(req, to_move);
+                std::vector<float> stored(W * H);
+                for (std::size_t i=0; i<W * H; ++i)
+                    stored[transform(key.second, i)] = probs[i];
+
+                Shard &s = shard(key.first);
+                std::lock_guard<std::mutex> lock(s.mutex);
+                if (s.index.count(key.first))
+                    return;
+                s.lru.emplace_front(key.first, std::move(stored));
+                s.index[key.first] = s.lru.begin();
+                entry_cnt.fetch_add(1);
+                bytes.fetch_add(W * H * sizeof(float));
+                if (s.lru.size() > max_entries_per_shard)
+                {
+                    s.index.erase(s.lru.back().first);
+                    s.lru.pop_back();
+                    entry_cnt.fetch_sub(1);
+                    bytes.fetch_sub(W * H * sizeof(float));
+                }
+            }
+
+            CNNCacheStats getStats() const
+            {
+                CNNCacheStats stats;
+                stats.hit_cnt = hit_cnt.load();
+                stats.miss_cnt = miss_cnt.load();
+                stats.entry_cnt = entry_cnt.load();
+                stats.bytes = bytes.load();
+                return stats;
+            }
+        };
+    }
+}
+
+#endif //LIBUCT_CNN_CACHE_HPP
@@ -7,23 +7,360 @@
 
 #include "message.pb.h"
 #include "logger.hpp"
+#include "bitplanes.hpp"
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/crc.hpp>
 #include <string>
 #include <cstdint>
 #include <vector>
+#include <array>
 #include <algorithm>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <stdexcept>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <thread>
 
 namespace uct
 {
     namespace detail
     {
         using namespace boost::asio;
+
+        enum class ConnectionMode
+        {
+            ONE_SHOT,   // connect, send one frame, read one frame, close (legacy servers)
+            KEEP_ALIVE  // pooled sockets; each connection carries many length-prefixed frames
+        };
+
+        // Heap buffer starting on a cache line. It only reallocates when asked for more than it holds, so a buffer
+        // kept per thread stops allocating once it has seen the largest frame.
+        class AlignedBuffer
+        {
+            static const std::size_t ALIGN = 64;
+            std::unique_ptr<char[]> raw;
+            char *data_ = nullptr;
+            std::size_t capacity_ = 0;
+        public:
+            char *reserve(std::size_t bytes)
+            {
+                if (bytes > capacity_)
+                {
+                    raw.reset(new char[bytes + ALIGN]);
+                    std::uintptr_t p = reinterpret_cast<std::uintptr_t>(raw.get());
+                    data_ = reinterpret_cast<char *>((p + ALIGN - 1) / ALIGN * ALIGN);
+                    capacity_ = bytes;
+                }
+                return data_;
+            }
+
+            char *data() { return data_; }
+            const char *data() const { return data_; }
+            std::size_t capacity() const { return capacity_; }
+        };
+
+        // Framing of every CNN call: [int64 len][payload] (+ [uint32 crc] when enabled), both ways
+        struct FrameConfig
+        {
+            std::size_t max_frame_size = 16 << 20; // a longer reply means the stream is out of sync
+            bool crc = false; // CRC-32 of the payload after each frame; the server must be configured alike
+        };
+
+        // Thrown when a reply frame is malformed: bad length or CRC mismatch
+        class CNNFrameError: public std::runtime_error
+        {
+        public:
+            explicit CNNFrameError(const std::string &what): std::runtime_error(what) {}
+        };
+
+        // Thrown when a CNN call misses its deadline or is cancelled
+        class CNNTimeoutError: public std::runtime_error
+        {
+        public:
+            explicit CNNTimeoutError(const std::string &what): std::runtime_error(what) {}
+        };
+
+        struct CNNLatencyStats
+        {
+            std::size_t call_cnt = 0;
+            std::size_t timeout_cnt = 0;
+            // over the most recent LatencyRecorder::WINDOW calls
+            double p50_ms = 0.0;
+            double p90_ms = 0.0;
+            double p99_ms = 0.0;
+            double max_ms = 0.0;
+        };
+
+        // Keeps the latency of the last WINDOW calls for percentile reporting
+        class LatencyRecorder
+        {
+        public:
+            static const std::size_t WINDOW = 4096;
+        private:
+            mutable std::mutex mutex;
+            std::vector<float> samples; // ring buffer, guarded by mutex
+            std::size_t call_cnt = 0;
+            std::size_t timeout_cnt = 0;
+        public:
+            void record(std::chrono::steady_clock::duration d, bool timed_out)
+            {
+                float ms = std::chrono::duration<float, std::milli>(d).count();
+                std::lock_guard<std::mutex> lock(mutex);
+                if (samples.size() < WINDOW)
+                    samples.push_back(ms);
+                else
+                    samples[call_cnt % WINDOW] = ms;
+                ++call_cnt;
+                if (timed_out)
+                    ++timeout_cnt;
+            }
+
+            CNNLatencyStats getStats() const
+            {
+                CNNLatencyStats stats;
+                std::vector<float> sorted;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stats.call_cnt = call_cnt;
+                    stats.timeout_cnt = timeout_cnt;
+                    sorted = samples;
+                }
+                if (sorted.empty())
+                    return stats;
+                std::sort(sorted.begin(), sorted.end());
+                auto at = [&](double q) { return (double) sorted[(std::size_t) (q * (sorted.size() - 1))]; };
+                stats.p50_ms = at(0.5);
+                stats.p90_ms = at(0.9);
+                stats.p99_ms = at(0.99);
+                stats.max_ms = sorted.back();
+                return stats;
+            }
+        };
+
         class CNNServiceBase
         {
+        public:
+            using Clock = std::chrono::steady_clock;
+            static const std::size_t MAX_GATHER = 3; // payload buffers in one frame
         protected:
+            using SocketPtr = std::unique_ptr<ip::tcp::socket>;
+
+            // One call on the async path. Every handler runs on io_thread, which also owns in_flight.
+            struct AsyncCall
+            {
+                explicit AsyncCall(io_service &service): timer(service) {}
+
+                SocketPtr sock;
+                bool reused = false; // sock came from the pool, so it is already connected
+                std::array<const_buffer, MAX_GATHER + 2> frame;
+                std::int64_t len = 0;
+                std::uint32_t crc = 0;
+                std::int64_t resp_len = 0;
+                std::uint32_t resp_crc = 0;
+                std::string frame_error; // set with ec on a malformed reply
+                AlignedBuffer *reply = nullptr;
+                Clock::time_point deadline; // max for none: only cancelAll ends the call early
+                std::uint64_t cancel_token = 0; // getCancelCount() before the caller worked out deadline
+                steady_timer timer;
+                int pending = 0; // handlers (I/O chain, timer) still to run
+                bool timed_out = false;
+                boost::system::error_code ec;
+                std::function<void()> on_done; // once nothing on io_thread refers to the call any more
+            };
+
             std::shared_ptr<spdlog::logger> logger = {getGlobalLogger()};
             io_service service;
             ip::tcp::endpoint ep;
+            const ConnectionMode mode;
+            const std::size_t max_idle_connections;
+            const FrameConfig frame_config;
+
+            std::mutex pool_mutex;
+            std::vector<SocketPtr> idle_sockets; // guarded by pool_mutex
+            std::atomic<std::size_t> connect_cnt {0};
+            std::atomic<std::uint64_t> cancel_cnt {0};
+            LatencyRecorder latency;
+
+            // Drives calls with a deadline; started by the first of them
+            std::once_flag io_once;
+            std::atomic<bool> io_started {false};
+            std::unique_ptr<io_service::work> io_work;
+            std::thread io_thread;
+            std::vector<AsyncCall *> in_flight; // io_thread only
+
+            void ensure_io_thread()
+            {
+                std::call_once(io_once, [this]() {
+                    io_work.reset(new io_service::work(service));
+                    io_thread = std::thread([this]() { service.run(); });
+                    io_started.store(true);
+                });
+            }
+
+            void finish_handler(AsyncCall *c)
+            {
+                if (--c->pending)
+                    return;
+                in_flight.erase(std::find(in_flight.begin(), in_flight.end(), c));
+                std::function<void()> done = std::move(c->on_done);
+                done();
+            }
+
+            void finish_io(AsyncCall *c, const boost::system::error_code &ec)
+            {
+                c->ec = c->timed_out ? error::timed_out : ec;
+                c->timer.cancel();
+                finish_handler(c);
+            }
+
+            static void abort_call(AsyncCall *c)
+            {
+                c->timed_out = true;
+                boost::system::error_code ignored;
+                c->sock->close(ignored);
+            }
+
+            static std::uint32_t crc32(const char *data, std::size_t len)
+            {
+                boost::crc_32_type crc;
+                crc.process_bytes(data, len);
+                return crc.checksum();
+            }
+
+            // The frame carrying parts: length prefix, the parts, then the CRC trailer (empty if disabled).
+            // len and crc are written, and must outlive the returned buffers.
+            template<std::size_t N, std::size_t M>
+            void frame_buffers(const std::array<const_buffer, N> &parts, std::array<const_buffer, M> &frame,
+                               std::int64_t &len, std::uint32_t &crc) const
+            {
+                static_assert(N + 2 <= M, "frame too small for parts");
+                len = buffer_size(parts);
+                frame.fill(const_buffer());
+                frame[0] = buffer(&len, 8);
+                std::copy(parts.begin(), parts.end(), frame.begin() + 1);
+                if (!frame_config.crc)
+                    return;
+                boost::crc_32_type sum;
+                for (const const_buffer &b: parts)
+                    sum.process_bytes(buffer_cast<const char *>(b), buffer_size(b));
+                crc = sum.checksum();
+                frame[N + 1] = buffer(&crc, 4);
+            }
+
+            // Empty if a reply of len bytes is acceptable, otherwise what is wrong with it
+            std::string check_reply_len(std::int64_t len) const
+            {
+                if (len < 0 || (std::size_t) len > frame_config.max_frame_size)
+                    return "CNN reply frame length " + std::to_string(len) + " out of range";
+                return std::string();
+            }
+
+            std::string check_reply_crc(const AlignedBuffer &reply, std::int64_t len, std::uint32_t crc) const
+            {
+                if (frame_config.crc && crc32(reply.data(), len) != crc)
+                    return "CNN reply frame CRC mismatch";
+                return std::string();
+            }
+
+            void fail_frame(AsyncCall *c, const std::string &what)
+            {
+                c->frame_error = what;
+                finish_io(c, boost::system::errc::make_error_code(boost::system::errc::bad_message));
+            }
+
+            void async_exchange(AsyncCall *c)
+            {
+                async_write(*c->sock, c->frame, [this, c](const boost::system::error_code &ec, std::size_t) {
+                    if (ec)
+                        return finish_io(c, ec);
+                    async_read(*c->sock, buffer(&c->resp_len, 8), [this, c](const boost::system::error_code &ec,
+                                                                             std::size_t) {
+                        if (ec)
+                            return finish_io(c, ec);
+                        std::string bad = check_reply_len(c->resp_len);
+                        if (!bad.empty())
+                            return fail_frame(c, bad);
+                        std::array<mutable_buffer, 2> payload {{
+                                buffer(c->reply->reserve(c->resp_len), c->resp_len),
+                                frame_config.crc ? buffer(&c->resp_crc, 4) : mutable_buffer() }};
+                        async_read(*c->sock, payload, [this, c](const boost::system::error_code &ec, std::size_t) {
+                            if (ec)
+                                return finish_io(c, ec);
+                            std::string bad = check_reply_crc(*c->reply, c->resp_len, c->resp_crc);
+                            if (!bad.empty())
+                                return fail_frame(c, bad);
+                            finish_io(c, ec);
+                        });
+                    });
+                });
+            }
+
+            // Run c on io_thread; c->on_done is called there once the call is over
+            void launch(AsyncCall *c)
+            {
+                ensure_io_thread();
+                service.post([this, c]() {
+                    in_flight.push_back(c);
+                    if (cancel_cnt.load() != c->cancel_token)
+                    {
+                        // cancelled between the caller's deadline and now, maybe before it was in in_flight
+                        c->pending = 1;
+                        c->timed_out = true;
+                        return finish_io(c, error::timed_out);
+                    }
+                    c->pending = 1;
+                    if (c->deadline != Clock::time_point::max())
+                    {
+                        ++c->pending;
+                        c->timer.expires_at(c->deadline);
+                        c->timer.async_wait([this, c](const boost::system::error_code &ec) {
+                            if (!ec && c->pending == 2) // the I/O chain is still running
+                                abort_call(c);
+                            finish_handler(c);
+                        });
+                    }
+                    if (c->reused)
+                        return async_exchange(c);
+                    c->sock->async_connect(ep, [this, c](const boost::system::error_code &ec) {
+                        if (ec)
+                            return finish_io(c, ec);
+                        connect_cnt.fetch_add(1);
+                        try
+                        {
+                            config_socket(*c->sock);
+                        } catch (const boost::system::system_error &e)
+                        {
+                            return finish_io(c, e.code());
+                        }
+                        async_exchange(c);
+                    });
+                });
+            }
+
+            template<std::size_t N>
+            void prepare(AsyncCall &c, const std::array<const_buffer, N> &parts, AlignedBuffer &reply,
+                         Clock::time_point deadline, std::uint64_t cancel_token)
+            {
+                static_assert(N <= MAX_GATHER, "too many buffers for one frame");
+                frame_buffers(parts, c.frame, c.len, c.crc);
+                c.reply = &reply;
+                c.deadline = deadline;
+                c.cancel_token = cancel_token;
+                c.sock = checkout(c.reused, false);
+            }
+
+            // The socket of a finished call goes back to the pool only if its frame exchange completed
+            void release(AsyncCall &c)
+            {
+                if (!c.ec && !c.timed_out)
+                    checkin(std::move(c.sock));
+            }
 
             static void config_socket(ip::tcp::socket &sock)
             {
@@ -32,43 +369,248 @@ namespace uct
                 sock.set_option(ra);
                 sock.set_option(nd);
             }
-        public:
-            CNNServiceBase(const std::string &addr, unsigned short port):
-                    ep(ip::address::from_string(addr), port)
-            {}
 
-            std::string sync_call(const std::string &message)
+            SocketPtr connect_new()
             {
-                logger->trace("Start a RPC");
-                ip::tcp::socket sock(service);
-                sock.connect(ep);
-                config_socket(sock);
+                SocketPtr sock(new ip::tcp::socket(service));
+                sock->connect(ep);
+                config_socket(*sock);
+                connect_cnt.fetch_add(1);
+                return sock;
+            }
 
-                std::int64_t len = message.size();
+            // Take an idle connection from the pool, or open a new one (left unconnected unless connect is set).
+            // reused is set if the socket came from the pool
+            SocketPtr checkout(bool &reused, bool connect = true)
+            {
+                if (mode == ConnectionMode::KEEP_ALIVE)
+                {
+                    std::lock_guard<std::mutex> lock(pool_mutex);
+                    if (!idle_sockets.empty())
+                    {
+                        SocketPtr sock = std::move(idle_sockets.back());
+                        idle_sockets.pop_back();
+                        reused = true;
+                        return sock;
+                    }
+                }
+                reused = false;
+                return connect ? connect_new() : SocketPtr(new ip::tcp::socket(service));
+            }
 
-                logger->trace("Start writing len");
-                sock.write_some(buffer(&len, 8));
-                logger->trace("Start writing msg");
-                sock.write_some(buffer(message));
+            void checkin(SocketPtr sock)
+            {
+                if (mode == ConnectionMode::KEEP_ALIVE)
+                {
+                    std::lock_guard<std::mutex> lock(pool_mutex);
+                    if (idle_sockets.size() < max_idle_connections)
+                    {
+                        idle_sockets.push_back(std::move(sock));
+                        return;
+                    }
+                }
+                sock->close();
+            }
+
+            // Write one frame gathered from parts with a single write, then read the reply frame into reply.
+            // The read loops until the whole frame is in, however the stream was segmented.
+            template<std::size_t N>
+            std::size_t call_on(ip::tcp::socket &sock, const std::array<const_buffer, N> &parts, AlignedBuffer &reply)
+            {
+                std::int64_t len = 0;
+                std::uint32_t crc = 0;
+                std::array<const_buffer, N + 2> frame;
+                frame_buffers(parts, frame, len, crc);
+                logger->trace("Start writing frame with len {}", len);
+                boost::asio::write(sock, frame);
 
                 std::int64_t resp_len = 0;
                 logger->trace("Start reading resp len");
-                sock.read_some(buffer(&resp_len, 8));
-                std::vector<char> result(resp_len);
+                boost::asio::read(sock, buffer(&resp_len, 8));
+                std::string bad = check_reply_len(resp_len);
+                if (!bad.empty())
+                    throw CNNFrameError(bad);
                 logger->trace("Start read msg with len {}", resp_len);
-                sock.read_some(buffer(result, resp_len));
-                sock.close();
-                std::string result_s;
-                std::copy(result.cbegin(), result.cend(), std::back_inserter(result_s));
-                return result_s;
+                std::uint32_t resp_crc = 0;
+                std::array<mutable_buffer, 2> payload {{
+                        buffer(reply.reserve(resp_len), resp_len),
+                        frame_config.crc ? buffer(&resp_crc, 4) : mutable_buffer() }};
+                boost::asio::read(sock, payload);
+                bad = check_reply_crc(reply, resp_len, resp_crc);
+                if (!bad.empty())
+                    throw CNNFrameError(bad);
+                return resp_len;
+            }
+        public:
+            CNNServiceBase(const std::string &addr, unsigned short port,
+                           ConnectionMode mode = ConnectionMode::ONE_SHOT, std::size_t max_idle_connections = 64,
+                           const FrameConfig &frame_config = FrameConfig()):
+                    ep(ip::address::from_string(addr), port), mode(mode), max_idle_connections(max_idle_connections),
+                    frame_config(frame_config)
+            {}
+
+            CNNServiceBase(const CNNServiceBase &) = delete;
+            CNNServiceBase& operator=(const CNNServiceBase &) = delete;
+
+            ~CNNServiceBase()
+            {
+                if (io_thread.joinable())
+                {
+                    io_work.reset();
+                    service.stop();
+                    io_thread.join();
+                }
+            }
+
+            // Send the concatenation of parts as one frame; the reply lands in reply and its length is returned.
+            // Nothing is allocated once reply is large enough and (in KEEP_ALIVE mode) a connection is pooled.
+            template<std::size_t N>
+            std::size_t sync_call(const std::array<const_buffer, N> &parts, AlignedBuffer &reply)
+            {
+                logger->trace("Start a RPC");
+                const Clock::time_point start = Clock::now();
+                bool reused = false;
+                SocketPtr sock = checkout(reused);
+                std::size_t len;
+                try
+                {
+                    len = call_on(*sock, parts, reply);
+                } catch (const boost::system::system_error &e)
+                {
+                    if (!reused)
+                        throw;
+                    // The server may drop idle keep-alive connections; retry once on a fresh one
+                    logger->debug("Pooled CNN connection failed ({}), reconnecting", e.what());
+                    sock = connect_new();
+                    len = call_on(*sock, parts, reply);
+                }
+                checkin(std::move(sock));
+                latency.record(Clock::now() - start, false);
+                return len;
+            }
+
+            // As above, but give up at deadline (Clock::time_point::max() for never) or on cancelAll by throwing
+            // CNNTimeoutError. Runs on the async path, so cancelAll reaches it whatever the deadline. A cancelAll
+            // after cancel_token was taken (getCancelCount()) aborts the call even if it comes before the call
+            // starts: take the token before working out the deadline, and a stop can't slip in between.
+            template<std::size_t N>
+            std::size_t sync_call(const std::array<const_buffer, N> &parts, AlignedBuffer &reply,
+                                  Clock::time_point deadline, std::uint64_t cancel_token)
+            {
+                const Clock::time_point start = Clock::now();
+                for (int attempt = 0; ; ++attempt)
+                {
+                    AsyncCall c(service);
+                    prepare(c, parts, reply, deadline, cancel_token);
+                    std::mutex m;
+                    std::condition_variable cv;
+                    bool done = false;
+                    c.on_done = [&]() {
+                        std::lock_guard<std::mutex> lock(m);
+                        done = true;
+                        cv.notify_one();
+                    };
+                    launch(&c);
+                    {
+                        std::unique_lock<std::mutex> lock(m);
+                        cv.wait(lock, [&]() { return done; });
+                    }
+                    release(c);
+                    if (!c.ec)
+                    {
+                        latency.record(Clock::now() - start, false);
+                        return c.resp_len;
+                    }
+                    if (c.timed_out)
+                    {
+                        latency.record(Clock::now() - start, true);
+                        throw CNNTimeoutError("CNN call missed its deadline");
+                    }
+                    if (!c.frame_error.empty())
+                        throw CNNFrameError(c.frame_error);
+                    if (!c.reused || attempt)
+                        throw boost::system::system_error(c.ec);
+                    logger->debug("Pooled CNN connection failed ({}), reconnecting", c.ec.message());
+                }
+            }
+
+            // As above with the current cancel token, except that without a deadline the call stays on the
+            // calling thread and cancelAll can't reach it
+            template<std::size_t N>
+            std::size_t sync_call(const std::array<const_buffer, N> &parts, AlignedBuffer &reply,
+                                  Clock::time_point deadline)
+            {
+                if (deadline == Clock::time_point::max())
+                    return sync_call(parts, reply);
+                return sync_call(parts, reply, deadline, getCancelCount());
+            }
+
+            // Start a call and return at once; handler(error_code, reply_len) runs on the service's I/O thread.
+            // The error is error::timed_out when deadline passes or cancelAll is called, errc::bad_message when
+            // the reply frame is malformed. parts and reply must stay
+            // valid until then.
+            template<std::size_t N, typename Handler>
+            void async_call(const std::array<const_buffer, N> &parts, AlignedBuffer &reply, Clock::time_point deadline,
+                            Handler handler)
+            {
+                std::shared_ptr<AsyncCall> c = std::make_shared<AsyncCall>(service);
+                prepare(*c, parts, reply, deadline, getCancelCount());
+                const Clock::time_point start = Clock::now();
+                c->on_done = [this, c, handler, start]() mutable {
+                    latency.record(Clock::now() - start, c->timed_out);
+                    release(*c);
+                    handler(c->ec, (std::size_t) c->resp_len);
+                    c.reset();
+                };
+                launch(c.get());
+            }
+
+            // Abort every call currently on the async path, and those yet to start with an older cancel token;
+            // their callers see a timeout
+            void cancelAll()
+            {
+                cancel_cnt.fetch_add(1);
+                if (!io_started.load())
+                    return;
+                service.post([this]() {
+                    for (AsyncCall *c: in_flight)
+                        abort_call(c);
+                });
+            }
+
+            CNNLatencyStats getLatencyStats() const
+            {
+                return latency.getStats();
+            }
+
+            std::string sync_call(const std::string &message)
+            {
+                AlignedBuffer reply;
+                std::array<const_buffer, 1> parts {{ buffer(message) }};
+                std::size_t len = sync_call(parts, reply);
+                return std::string(reply.data(), len);
+            }
+
+            // Calls to cancelAll so far, the cancel token of a call starting now
+            std::uint64_t getCancelCount() const
+            {
+                return cancel_cnt.load();
+            }
+
+            // Number of TCP connections opened so far
+            std::size_t getConnectCount() const
+            {
+                return connect_cnt.load();
             }
         };
 
         class RequestV1Service: protected CNNServiceBase
         {
         public:
-            RequestV1Service(const std::string &addr, unsigned short port):
-                    CNNServiceBase(addr, port)
+            RequestV1Service(const std::string &addr, unsigned short port,
+                             ConnectionMode mode = ConnectionMode::ONE_SHOT,
+                             const FrameConfig &frame_config = FrameConfig()):
+                    CNNServiceBase(addr, port, mode, 64, frame_config)
             {}
 
             gocnn::ResponseV1 sync_call(const gocnn::RequestV1 &reqV1)
@@ -83,8 +625,10 @@ namespace uct
         class RequestV2Service: protected CNNServiceBase
         {
         public:
-            RequestV2Service(const std::string &addr, unsigned short port):
-                    CNNServiceBase(addr, port)
+            RequestV2Service(const std::string &addr, unsigned short port,
+                             ConnectionMode mode = ConnectionMode::ONE_SHOT,
+                             const FrameConfig &frame_config = FrameConfig()):
+                    CNNServiceBase(addr, port, mode, 64, frame_config)
             {}
 
             gocnn::ResponseV2 sync_call(const gocnn::RequestV2 &reqV2)
@@ -96,17 +640,192 @@ namespace uct
             }
         };
 
+        enum class WireFormat
+        {
+            BYTE_PLANES, // compact format: 38 planes of one byte per point, then the float plane
+            BIT_PLANES   // a PackedFrameHeader, 38 bit-packed planes, then the float plane (~4x smaller on 19x19)
+        };
+
+        // Leads every BIT_PLANES request. Byte-plane requests only start with 0 or 1, so a server tells the two
+        // formats apart from the first byte and can serve both on one port.
+        struct PackedFrameHeader
+        {
+            static const std::uint32_t MAGIC = 0x54494247; // "GBIT" on the wire
+            static const std::uint16_t FORMAT_BITS_V1 = 1;
+
+            std::uint32_t magic;
+            std::uint16_t format;
+            std::uint16_t board_size;
+        };
+
         class RequestV2ServiceCompact: protected CNNServiceBase
         {
         public:
-            RequestV2ServiceCompact(const std::string &addr, unsigned short port):
-                    CNNServiceBase(addr, port)
+            using CNNServiceBase::Clock;
+            using CNNServiceBase::cancelAll;
+            using CNNServiceBase::getCancelCount;
+            using CNNServiceBase::getLatencyStats;
+        private:
+            // Per-thread frame buffers, reused by every call
+            struct Scratch
+            {
+                AlignedBuffer request;
+                AlignedBuffer planes; // byte planes waiting to be bit-packed
+                AlignedBuffer reply;
+            };
+
+            const WireFormat format;
+
+            static Scratch &scratch()
+            {
+                static thread_local Scratch s;
+                return s;
+            }
+
+            static std::uint64_t read_varint(const char *&p, const char *end)
+            {
+                std::uint64_t v = 0;
+                for (int shift = 0; p < end && shift < 64; shift += 7)
+                {
+                    std::uint8_t byte = static_cast<std::uint8_t>(*p++);
+                    v |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+                    if (!(byte & 0x80))
+                        return v;
+                }
+                throw std::runtime_error("Malformed varint in CNN response");
+            }
+
+            // Write the planes of reqV2 in this service's format to s.request; returns their size in bytes.
+            // s.request has room for the float plane after them.
+            std::size_t write_planes(const gocnn::RequestV2 &reqV2, Scratch &s) const
+            {
+                const std::size_t bs = reqV2.board_size();
+                if (format == WireFormat::BYTE_PLANES)
+                {
+                    encode_planes(reqV2, s.request.reserve(compact_size(bs)));
+                    return 38 * bs;
+                }
+                char *bytes = s.planes.reserve(38 * bs);
+                encode_planes(reqV2, bytes);
+                return pack_planes(bs, bytes, s.request.reserve(packed_size(bs)));
+            }
+
+            // Request frame as gather parts: the planes from the scratch buffer, followed by the position plane
+            // taken straight from reqV2's storage when it has the expected size
+            std::array<const_buffer, 2> frame_parts(const gocnn::RequestV2 &reqV2, Scratch &s) const
+            {
+                const std::size_t bs = reqV2.board_size();
+                std::size_t planes_size = write_planes(reqV2, s);
+                char *pchar = s.request.data();
+                if ((std::size_t) reqV2.position_size() == bs)
+                    return {{ buffer(pchar, planes_size), buffer(reqV2.position().data(), 4 * bs) }};
+                encode_position(reqV2, pchar + planes_size);
+                return {{ buffer(pchar, planes_size + 4 * bs), const_buffer() }};
+            }
+        public:
+            RequestV2ServiceCompact(const std::string &addr, unsigned short port,
+                                    ConnectionMode mode = ConnectionMode::ONE_SHOT,
+                                    WireFormat format = WireFormat::BYTE_PLANES,
+                                    const FrameConfig &frame_config = FrameConfig()):
+                    CNNServiceBase(addr, port, mode, 64, frame_config), format(format)
             {}
 
-            gocnn::ResponseV2 sync_call(const gocnn::RequestV2 &reqV2)
+            // Bytes taken by one request in the compact format: 38 byte planes + one float plane
+            static std::size_t compact_size(std::size_t board_size)
+            {
+                return 38 * board_size + 4 * board_size;
+            }
+
+            // Bytes taken by one request in the BIT_PLANES format
+            static std::size_t packed_size(std::size_t board_size)
             {
-                auto pair = std::get_temporary_buffer<char>(38 * reqV2.board_size() + 4 * reqV2.board_size());
-                auto pchar = pair.first;
+                return sizeof(PackedFrameHeader) + 38 * packed_plane_size(board_size) + 4 * board_size;
+            }
+
+            // Bytes taken by one request in this service's format
+            std::size_t frame_size(std::size_t board_size) const
+            {
+                return format == WireFormat::BYTE_PLANES ? compact_size(board_size) : packed_size(board_size);
+            }
+
+            // Write the header and the bit-packed form of 38 byte planes to out; returns the bytes written
+            static std::size_t pack_planes(std::size_t board_size, const char *byte_planes, char *out)
+            {
+                PackedFrameHeader header;
+                header.magic = PackedFrameHeader::MAGIC;
+                header.format = PackedFrameHeader::FORMAT_BITS_V1;
+                header.board_size = static_cast<std::uint16_t>(board_size);
+                std::memcpy(out, &header, sizeof(header));
+                std::uint8_t *packed = reinterpret_cast<std::uint8_t *>(out + sizeof(header));
+                const std::size_t plane = packed_plane_size(board_size);
+                for (std::size_t i=0; i<38; ++i)
+                    pack_bits(byte_planes + i * board_size, board_size, packed + i * plane);
+                return sizeof(header) + 38 * plane;
+            }
+
+            // Whether a request frame starts with a PackedFrameHeader
+            static bool is_packed(const char *data, std::size_t len)
+            {
+                std::uint32_t magic = 0;
+                if (len >= sizeof(magic))
+                    std::memcpy(&magic, data, sizeof(magic));
+                return magic == PackedFrameHeader::MAGIC;
+            }
+
+            // Server side of BIT_PLANES: turn the packed request at data into the compact format. compact is
+            // resized to compact_size(board_size); returns the bytes consumed from data.
+            static std::size_t decode_packed(const char *data, std::size_t len, std::string &compact)
+            {
+                PackedFrameHeader header;
+                if (len < sizeof(header))
+                    throw std::runtime_error("Truncated packed CNN request");
+                std::memcpy(&header, data, sizeof(header));
+                if (header.magic != PackedFrameHeader::MAGIC || header.format != PackedFrameHeader::FORMAT_BITS_V1)
+                    throw std::runtime_error("Unknown packed CNN request format");
+                const std::size_t bs = header.board_size;
+                if (len < packed_size(bs))
+                    throw std::runtime_error("Truncated packed CNN request");
+
+                compact.resize(compact_size(bs));
+                const std::uint8_t *packed = reinterpret_cast<const std::uint8_t *>(data + sizeof(header));
+                const std::size_t plane = packed_plane_size(bs);
+                for (std::size_t i=0; i<38; ++i)
+                    unpack_bits(packed + i * plane, bs, &compact[i * bs]);
+                std::memcpy(&compact[38 * bs], packed + 38 * plane, 4 * bs);
+                return packed_size(bs);
+            }
+
+            // Write reqV2 in this service's format to pchar, which must hold frame_size(reqV2.board_size()) bytes
+            void encode_frame(const gocnn::RequestV2 &reqV2, char *pchar) const
+            {
+                if (format == WireFormat::BYTE_PLANES)
+                    return encode(reqV2, pchar);
+                const std::size_t bs = reqV2.board_size();
+                char *bytes = scratch().planes.reserve(38 * bs);
+                encode_planes(reqV2, bytes);
+                encode_position(reqV2, pchar + pack_planes(bs, bytes, pchar));
+            }
+
+            // Write reqV2 in the compact format to pchar, which must hold compact_size(reqV2.board_size()) bytes
+            static void encode(const gocnn::RequestV2 &reqV2, char *pchar)
+            {
+                encode_planes(reqV2, pchar);
+                encode_position(reqV2, pchar + 38 * reqV2.board_size());
+            }
+
+            // The float plane of the compact format, zero-padded to board_size values
+            static void encode_position(const gocnn::RequestV2 &reqV2, char *pchar)
+            {
+                const std::size_t bs = reqV2.board_size();
+                const std::size_t n = std::min<std::size_t>(bs, reqV2.position_size());
+                std::memcpy(pchar, reqV2.position().data(), 4 * n);
+                std::memset(pchar + 4 * n, 0, 4 * (bs - n));
+            }
+
+            // The 38 byte planes of the compact format
+            static void encode_planes(const gocnn::RequestV2 &reqV2, char *pchar)
+            {
+                std::memset(pchar, 0, 38 * reqV2.board_size()); // planes missing from reqV2 read as zero
                 std::copy(reqV2.stone_color_our().begin(), reqV2.stone_color_our().end(), pchar);
                 std::copy(reqV2.stone_color_oppo().begin(), reqV2.stone_color_oppo().end(), pchar + reqV2.board_size());
                 std::copy(reqV2.stone_color_empty().begin(), reqV2.stone_color_empty().end(), pchar + 2 * reqV2.board_size());
@@ -151,20 +870,144 @@ namespace uct
                 std::copy(reqV2.sensibleness().begin(), reqV2.sensibleness().end(), pchar + 35 * reqV2.board_size());
                 std::copy(reqV2.ko().begin(), reqV2.ko().end(), pchar + 36 * reqV2.board_size());
                 std::copy(reqV2.border().begin(), reqV2.border().end(), pchar + 37 * reqV2.board_size());
+            }
 
-                float *start = (float *)(pchar + 38 * reqV2.board_size());
-                std::copy(reqV2.position().begin(), reqV2.position().end(), start);
-
-                std::string s;
-                std::copy(pchar, pchar + 38 * reqV2.board_size() + 4 * reqV2.board_size(), std::back_inserter(s));
-
-                std::string resp = CNNServiceBase::sync_call(s);
-                std::return_temporary_buffer(pchar);
+            // Read the possibility floats of a serialized ResponseV2 into possibility (replacing its content),
+            // packed or not, without building the message. Floats are assumed little-endian like the wire format.
+            static void decode_possibility(const char *data, std::size_t len, std::vector<float> &possibility)
+            {
+                possibility.clear();
+                const char *p = data, *end = data + len;
+                while (p < end)
+                {
+                    std::uint64_t tag = read_varint(p, end);
+                    const std::uint64_t field = tag >> 3;
+                    const bool wanted = field == (std::uint64_t) gocnn::ResponseV2::kPossibilityFieldNumber;
+                    std::size_t skip = 0;
+                    switch (tag & 7)
+                    {
+                        case 0: // varint
+                            read_varint(p, end);
+                            break;
+                        case 1: // fixed64
+                            skip = 8;
+                            break;
+                        case 2: // length-delimited: packed floats if wanted
+                            skip = read_varint(p, end);
+                            if (wanted && skip % 4 == 0 && skip <= (std::size_t) (end - p))
+                            {
+                                std::size_t old = possibility.size();
+                                possibility.resize(old + skip / 4);
+                                std::memcpy(possibility.data() + old, p, skip);
+                            }
+                            break;
+                        case 5: // fixed32
+                            skip = 4;
+                            if (wanted && end - p >= 4)
+                            {
+                                float f;
+                                std::memcpy(&f, p, 4);
+                                possibility.push_back(f);
+                            }
+                            break;
+                        default:
+                            throw std::runtime_error("Unsupported wire type in CNN response");
+                    }
+                    if (skip > (std::size_t) (end - p))
+                        throw std::runtime_error("Truncated CNN response");
+                    p += skip;
+                }
+            }
 
+            gocnn::ResponseV2 sync_call(const gocnn::RequestV2 &reqV2)
+            {
+                Scratch &s = scratch();
+                std::size_t len = CNNServiceBase::sync_call(frame_parts(reqV2, s), s.reply);
                 gocnn::ResponseV2 respV2;
-                respV2.ParseFromString(resp);
+                respV2.ParseFromArray(s.reply.data(), (int) len);
                 return respV2;
             }
+
+            // Like sync_call, but decode only the possibility floats into the caller's buffer. Frames go through
+            // per-thread buffers, so a caller reusing possibility allocates nothing in steady state.
+            // Throws CNNTimeoutError if the reply isn't in by deadline, or on cancelAll (see CNNServiceBase).
+            void sync_call(const gocnn::RequestV2 &reqV2, std::vector<float> &possibility,
+                           Clock::time_point deadline, std::uint64_t cancel_token)
+            {
+                Scratch &s = scratch();
+                std::size_t len = CNNServiceBase::sync_call(frame_parts(reqV2, s), s.reply, deadline, cancel_token);
+                decode_possibility(s.reply.data(), len, possibility);
+            }
+
+            // Without a cancel token, a call without deadline blocks on the calling thread (see CNNServiceBase)
+            void sync_call(const gocnn::RequestV2 &reqV2, std::vector<float> &possibility,
+                           Clock::time_point deadline = Clock::time_point::max())
+            {
+                Scratch &s = scratch();
+                std::size_t len = CNNServiceBase::sync_call(frame_parts(reqV2, s), s.reply, deadline);
+                decode_possibility(s.reply.data(), len, possibility);
+            }
+
+            // reqV2 in this service's format, as one request of a batch
+            std::string encode_request(const gocnn::RequestV2 &reqV2) const
+            {
+                std::string s(frame_size(reqV2.board_size()), '\0');
+                encode_frame(reqV2, &s[0]);
+                return s;
+            }
+
+            // Batched call: the frame holds reqs.size() requests in this service's format back to back (the server derives
+            // the count from the frame length). With more than one request the reply frame is a sequence of
+            // [int64 len][ResponseV2] records in request order; a batch of one uses the plain reply.
+            // All requests must share the same board_size.
+            std::vector<gocnn::ResponseV2> batch_sync_call(const std::vector<const gocnn::RequestV2 *> &reqs)
+            {
+                std::vector<std::string> frames;
+                frames.reserve(reqs.size());
+                for (const gocnn::RequestV2 *req: reqs)
+                {
+                    assert(req->board_size() == reqs[0]->board_size());
+                    frames.push_back(encode_request(*req));
+                }
+                return batch_sync_call(frames, Clock::time_point::max(), getCancelCount());
+            }
+
+            // As above, on requests already encoded by encode_request. Gives up at deadline or on cancelAll like the
+            // single-request sync_call.
+            std::vector<gocnn::ResponseV2> batch_sync_call(const std::vector<std::string> &frames,
+                                                           Clock::time_point deadline, std::uint64_t cancel_token)
+            {
+                std::vector<gocnn::ResponseV2> resps(frames.size());
+                if (frames.empty())
+                    return resps;
+                std::string s;
+                s.reserve(frames[0].size() * frames.size());
+                for (const std::string &f: frames)
+                    s += f;
+
+                AlignedBuffer reply;
+                std::array<const_buffer, 1> parts {{ buffer(s) }};
+                std::size_t len = CNNServiceBase::sync_call(parts, reply, deadline, cancel_token);
+                if (frames.size() == 1)
+                {
+                    resps[0].ParseFromArray(reply.data(), (int) len);
+                    return resps;
+                }
+                std::size_t offset = 0;
+                for (std::size_t i=0; i<frames.size(); ++i)
+                {
+                    std::int64_t len_i = 0;
+                    if (offset + 8 > len)
+                        throw std::runtime_error("Truncated batched CNN response");
+                    std::copy(reply.data() + offset, reply.data() + offset + 8, (char *)&len_i);
+                    offset += 8;
+                    if (len_i < 0 || offset + len_i > len)
+                        throw std::runtime_error("Truncated batched CNN response");
+                    resps[i].ParseFromArray(reply.data() + offset, (int)len_i);
+                    offset += len_i;
+                }
+                return resps;
+            }
         };
     }
 }
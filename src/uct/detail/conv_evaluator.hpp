@@ -0,0 +1,281 @@
+//
+// Created by lz on 1/21/17.
+//
+
+#ifndef LIBUCT_CONV_EVALUATOR_HPP
+#define LIBUCT_CONV_EVALUATOR_HPP
+
+#include "evaluator.hpp"
+#include "cnn_v1.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+namespace uct
+{
+    namespace detail
+    {
+        // One convolution of a ConvPolicyEvaluator: kernel x kernel, stride 1, zero padded to keep the board size
+        struct ConvLayer
+        {
+            std::uint32_t in_channels;
+            std::uint32_t out_channels;
+            std::uint32_t kernel; // odd
+            bool relu;
+            std::vector<float> weights; // [out_channels][in_channels][dx][dy]
+            std::vector<float> bias; // [out_channels]
+        };
+
+        // In-process policy network: a stack of convolutions over the 39 compact planes (38 binary planes, then
+        // the position plane) ending in a single channel, soft-maxed over the board. Each layer is run as im2col
+        // followed by a matrix product whose inner loop is an SSE axpy over board points.
+        //
+        // Weights file (little-endian): uint32 magic, version, width, height, layer count; then per layer uint32
+        // in_channels, out_channels, kernel, relu, followed by the float weights and biases in ConvLayer order.
+        class ConvPolicyEvaluator: public PolicyEvaluator
+        {
+        public:
+            static const std::uint32_t MAGIC = 0x57544355; // "UCTW" on disk
+            static const std::uint32_t VERSION = 1;
+            static const std::size_t INPUT_PLANES = 39;
+        private:
+            std::size_t width;
+            std::size_t height; // point (x, y) is plane index x * height + y
+            std::vector<ConvLayer> layers;
+            LatencyRecorder latency;
+
+            // Per-thread activations, reused by every evaluation
+            struct Scratch
+            {
+                std::string compact;
+                std::vector<float> input;
+                std::vector<float> cols;
+                std::vector<float> output;
+            };
+
+            static Scratch &scratch()
+            {
+                static thread_local Scratch s;
+                return s;
+            }
+
+            void validate() const
+            {
+                if (!width || !height || layers.empty())
+                    throw std::invalid_argument("ConvPolicyEvaluator needs a board and at least one layer");
+                std::size_t channels = INPUT_PLANES;
+                for (const ConvLayer &l: layers)
+                {
+                    if (l.in_channels != channels || l.kernel % 2 == 0 ||
+                        l.weights.size() != (std::size_t) l.out_channels * l.in_channels * l.kernel * l.kernel ||
+                        l.bias.size() != l.out_channels)
+                        throw std::invalid_argument("Inconsistent ConvPolicyEvaluator layer");
+                    channels = l.out_channels;
+                }
+                if (channels != 1)
+                    throw std::invalid_argument("ConvPolicyEvaluator must end with a single channel");
+            }
+
+            // cols[(c * k * k + dx * k + dy) * n + x * height + y] = in[c][x + dx - k / 2][y + dy - k / 2], or 0
+            // outside the board
+            void im2col(const float *in, std::size_t channels, std::size_t k, float *cols) const
+            {
+                const std::size_t n = width * height;
+                const long pad = (long) k / 2;
+                for (std::size_t c=0; c<channels; ++c)
+                    for (std::size_t dx=0; dx<k; ++dx)
+                        for (std::size_t dy=0; dy<k; ++dy)
+                        {
+                            float *row = cols + ((c * k + dx) * k + dy) * n;
+                            for (long x=0; x<(long) width; ++x)
+                            {
+                                long sx = x + (long) dx - pad;
+                                for (long y=0; y<(long) height; ++y)
+                                {
+                                    long sy = y + (long) dy - pad;
+                                    bool inside = sx >= 0 && sx < (long) width && sy >= 0 && sy < (long) height;
+                                    row[x * height + y] = inside ? in[c * n + sx * height + sy] : 0.0f;
+                                }
+                            }
+                        }
+            }
+
+            // y += a * x
+            static void axpy(float a, const float *x, float *y, std::size_t n)
+            {
+                std::size_t i = 0;
+#ifdef __SSE__
+                const __m128 va = _mm_set1_ps(a);
+                for (; i + 4 <= n; i += 4)
+                    _mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(va, _mm_loadu_ps(x + i))));
+#endif
+                for (; i < n; ++i)
+                    y[i] += a * x[i];
+            }
+
+            static void relu(float *x, std::size_t n)
+            {
+                std::size_t i = 0;
+#ifdef __SSE__
+                const __m128 zero = _mm_setzero_ps();
+                for (; i + 4 <= n; i += 4)
+                    _mm_storeu_ps(x + i, _mm_max_ps(_mm_loadu_ps(x + i), zero));
+#endif
+                for (; i < n; ++i)
+                    x[i] = std::max(x[i], 0.0f);
+            }
+
+            // out[o][p] = bias[o] + sum_j weights[o][j] * cols[j][p]
+            static void gemm(const ConvLayer &l, const float *cols, std::size_t n, float *out)
+            {
+                const std::size_t depth = (std::size_t) l.in_channels * l.kernel * l.kernel;
+                for (std::size_t o=0; o<l.out_channels; ++o)
+                {
+                    float *row = out + o * n;
+                    std::fill(row, row + n, l.bias[o]);
+                    const float *w = &l.weights[o * depth];
+                    for (std::size_t j=0; j<depth; ++j)
+                        if (w[j] != 0.0f)
+                            axpy(w[j], cols + j * n, row, n);
+                }
+            }
+
+            static std::uint32_t read_u32(std::istream &in)
+            {
+                std::uint32_t v;
+                if (!in.read(reinterpret_cast<char *>(&v), sizeof(v)))
+                    throw std::runtime_error("Truncated weights file");
+                return v;
+            }
+
+            static void read_floats(std::istream &in, std::vector<float> &v, std::size_t n)
+            {
+                v.resize(n);
+                if (!in.read(reinterpret_cast<char *>(v.data()), n * sizeof(float)))
+                    throw std::runtime_error("Truncated weights file");
+            }
+
+            static void write_u32(std::ostream &out, std::uint32_t v)
+            {
+                out.write(reinterpret_cast<const char *>(&v), sizeof(v));
+            }
+        public:
+            ConvPolicyEvaluator(std::size_t width, std::size_t height, std::vector<ConvLayer> layers):
+                    width(width), height(height), layers(std::move(layers))
+            {
+                validate();
+            }
+
+            explicit ConvPolicyEvaluator(const std::string &weights_file)
+            {
+                std::ifstream in(weights_file, std::ios::binary);
+                if (!in)
+                    throw std::runtime_error("Cannot open weights file " + weights_file);
+                if (read_u32(in) != MAGIC || read_u32(in) != VERSION)
+                    throw std::runtime_error("Not a version 1 weights file: " + weights_file);
+                width = read_u32(in);
+                height = read_u32(in);
+                layers.resize(read_u32(in));
+                for (ConvLayer &l: layers)
+                {
+                    l.in_channels = read_u32(in);
+                    l.out_channels = read_u32(in);
+                    l.kernel = read_u32(in);
+                    l.relu = read_u32(in) != 0;
+                    read_floats(in, l.weights, (std::size_t) l.out_channels * l.in_channels * l.kernel * l.kernel);
+                    read_floats(in, l.bias, l.out_channels);
+                }
+                validate();
+            }
+
+            void save(const std::string &weights_file) const
+            {
+                std::ofstream out(weights_file, std::ios::binary);
+                write_u32(out, MAGIC);
+                write_u32(out, VERSION);
+                write_u32(out, (std::uint32_t) width);
+                write_u32(out, (std::uint32_t) height);
+                write_u32(out, (std::uint32_t) layers.size());
+                for (const ConvLayer &l: layers)
+                {
+                    write_u32(out, l.in_channels);
+                    write_u32(out, l.out_channels);
+                    write_u32(out, l.kernel);
+                    write_u32(out, l.relu ? 1 : 0);
+                    out.write(reinterpret_cast<const char *>(l.weights.data()), l.weights.size() * sizeof(float));
+                    out.write(reinterpret_cast<const char *>(l.bias.data()), l.bias.size() * sizeof(float));
+                }
+                if (!out)
+                    throw std::runtime_error("Cannot write weights file " + weights_file);
+            }
+
+            // Run the network on req; no allocation once the calling thread has evaluated a request before
+            void forward(const gocnn::RequestV2 &req, std::vector<float> &possibility) const
+            {
+                const std::size_t n = width * height;
+                if ((std::size_t) req.board_size() != n)
+                    throw std::invalid_argument("Request board size doesn't match the network");
+                Scratch &s = scratch();
+                s.compact.resize(RequestV2ServiceCompact::compact_size(n));
+                RequestV2ServiceCompact::encode(req, &s.compact[0]);
+                s.input.resize(INPUT_PLANES * n);
+                std::copy(s.compact.data(), s.compact.data() + 38 * n, s.input.begin());
+                std::copy(reinterpret_cast<const char *>(&s.compact[38 * n]), s.compact.data() + s.compact.size(),
+                          reinterpret_cast<char *>(&s.input[38 * n]));
+
+                for (const ConvLayer &l: layers)
+                {
+                    const float *cols = s.input.data();
+                    if (l.kernel > 1)
+                    {
+                        s.cols.resize((std::size_t) l.in_channels * l.kernel * l.kernel * n);
+                        im2col(s.input.data(), l.in_channels, l.kernel, s.cols.data());
+                        cols = s.cols.data();
+                    }
+                    s.output.resize((std::size_t) l.out_channels * n);
+                    gemm(l, cols, n, s.output.data());
+                    if (l.relu)
+                        relu(s.output.data(), s.output.size());
+                    std::swap(s.input, s.output);
+                }
+
+                // soft-max over the single output channel
+                possibility.resize(n);
+                const float top = *std::max_element(s.input.begin(), s.input.begin() + n);
+                float sum = 0.0f;
+                for (std::size_t i=0; i<n; ++i)
+                    sum += possibility[i] = std::exp(s.input[i] - top);
+                for (std::size_t i=0; i<n; ++i)
+                    possibility[i] /= sum;
+            }
+
+            // A forward pass is short and bounded, so neither the deadline nor cancelAll is checked
+            virtual void evaluate(const gocnn::RequestV2 &req, std::vector<float> &possibility,
+                                  Clock::time_point, std::uint64_t) override
+            {
+                const Clock::time_point start = Clock::now();
+                forward(req, possibility);
+                latency.record(Clock::now() - start, false);
+            }
+
+            virtual CNNLatencyStats getLatencyStats() const override
+            {
+                return latency.getStats();
+            }
+
+            std::size_t getWidth() const { return width; }
+            std::size_t getHeight() const { return height; }
+        };
+    }
+}
+
+#endif //LIBUCT_CONV_EVALUATOR_HPP
@@ -0,0 +1,98 @@
+//
+// Created by lz on 1/21/17.
+//
+
+#ifndef LIBUCT_EVALUATOR_HPP
+#define LIBUCT_EVALUATOR_HPP
+
+#include "message.pb.h"
+#include "cnn_v1.hpp"
+#include "cnn_batch.hpp"
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace uct
+{
+    namespace detail
+    {
+        // Source of move probabilities for the tree policy. Implementations must allow concurrent evaluate calls.
+        class PolicyEvaluator
+        {
+        public:
+            using Clock = std::chrono::steady_clock;
+
+            // Fill possibility with req.board_size() move probabilities, indexed like the request planes.
+            // May throw CNNTimeoutError once deadline has passed, or once cancelAll is called after cancel_token
+            // (getCancelCount()) was taken.
+            virtual void evaluate(const gocnn::RequestV2 &req, std::vector<float> &possibility,
+                                  Clock::time_point deadline, std::uint64_t cancel_token) = 0;
+
+            // Abort evaluations in progress, and those still to start with an older cancel token, if the
+            // implementation can
+            virtual void cancelAll() {}
+
+            // Calls to cancelAll so far. Take it before working out the deadline of an evaluate call, so that a
+            // cancelAll between the two still reaches the call.
+            virtual std::uint64_t getCancelCount()
+            {
+                return 0;
+            }
+
+            virtual CNNLatencyStats getLatencyStats() const
+            {
+                return CNNLatencyStats();
+            }
+
+            virtual ~PolicyEvaluator() {}
+        };
+
+        // Evaluates on a CNN server over TCP, through a CNNBatchBroker when batching is enabled
+        class RemotePolicyEvaluator: public PolicyEvaluator
+        {
+            RequestV2ServiceCompact service;
+            std::unique_ptr<CNNBatchBroker> broker; // @nullable, used instead of service if set
+        public:
+            RemotePolicyEvaluator(const std::string &addr, unsigned short port, ConnectionMode mode,
+                                  WireFormat format, const FrameConfig &frame_config, bool batching,
+                                  const CNNBatchConfig &batch_config):
+                    service(addr, port, mode, format, frame_config),
+                    broker(batching ? new CNNBatchBroker(addr, port, batch_config, ConnectionMode::KEEP_ALIVE,
+                                                         format, frame_config) : nullptr)
+            {}
+
+            virtual void evaluate(const gocnn::RequestV2 &req, std::vector<float> &possibility,
+                                  Clock::time_point deadline, std::uint64_t cancel_token) override
+            {
+                if (broker)
+                {
+                    auto resp = broker->sync_call(req, deadline, cancel_token);
+                    possibility.assign(resp.possibility().begin(), resp.possibility().end());
+                } else
+                    service.sync_call(req, possibility, deadline, cancel_token);
+            }
+
+            virtual void cancelAll() override
+            {
+                if (broker)
+                    broker->cancelAll();
+                else
+                    service.cancelAll();
+            }
+
+            virtual std::uint64_t getCancelCount() override
+            {
+                return broker ? broker->getCancelCount() : service.getCancelCount();
+            }
+
+            virtual CNNLatencyStats getLatencyStats() const override
+            {
+                return service.getLatencyStats();
+            }
+        };
+    }
+}
+
+#endif //LIBUCT_EVALUATOR_HPP
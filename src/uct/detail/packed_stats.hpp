@@ -0,0 +1,114 @@
+//
+// Created by lz on 1/23/17.
+//
+
+#ifndef LIBUCT_PACKED_STATS_HPP
+#define LIBUCT_PACKED_STATS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+namespace uct
+{
+    namespace detail
+    {
+        // Visit count and mean value of the playouts through a node, packed in one 64-bit word: a backup changes
+        // both with a single CAS, so a reader always sees a pair some backup actually produced. The low half is
+        // the visit count, the high half the mean as a float; keeping the mean rather than the sum means it can't
+        // overflow. It is not exact, though: each backup rounds the mean to 24 bits, so the error builds up with
+        // the visit count, and once (value - mean) / visit_cnt drops below half an ulp of the mean (around 10^7
+        // visits for a mean near 0.5) further playouts no longer move it. Selection only compares means to a few
+        // digits, which is plenty, but don't read the mean of a heavily visited node as an exact average.
+        class PackedStats
+        {
+            std::atomic<std::uint64_t> bits_ {0};
+
+            static std::uint64_t pack(std::uint32_t visit_cnt, float mean)
+            {
+                std::uint32_t mean_bits;
+                std::memcpy(&mean_bits, &mean, sizeof(mean_bits));
+                return (std::uint64_t) mean_bits << 32 | visit_cnt;
+            }
+
+        public:
+            struct Snapshot
+            {
+                std::uint32_t visit_cnt;
+                float mean;
+
+                // Q in UCT: the sum of the playout values
+                double getQ() const
+                {
+                    return (double) mean * visit_cnt;
+                }
+            };
+
+            PackedStats() = default;
+
+            PackedStats(const PackedStats &other): bits_(other.bits_.load())
+            {}
+
+            PackedStats& operator= (const PackedStats &other)
+            {
+                bits_.store(other.bits_.load());
+                return *this;
+            }
+
+            Snapshot load(std::memory_order order = std::memory_order_seq_cst) const
+            {
+                std::uint64_t bits = bits_.load(order);
+                Snapshot s;
+                s.visit_cnt = (std::uint32_t) bits;
+                std::uint32_t mean_bits = (std::uint32_t) (bits >> 32);
+                std::memcpy(&s.mean, &mean_bits, sizeof(s.mean));
+                return s;
+            }
+
+            // The packed word itself: visit count in the low half, the bits of the mean in the high half
+            std::uint64_t loadBits(std::memory_order order = std::memory_order_seq_cst) const
+            {
+                return bits_.load(order);
+            }
+
+            void store(std::uint32_t visit_cnt, float mean)
+            {
+                bits_.store(pack(visit_cnt, mean));
+            }
+
+            // Count one more playout worth value
+            void add(double value)
+            {
+                std::uint64_t bits = bits_.load(std::memory_order_relaxed);
+                for (;;)
+                {
+                    std::uint32_t visit_cnt = (std::uint32_t) bits + 1;
+                    std::uint32_t mean_bits = (std::uint32_t) (bits >> 32);
+                    float mean;
+                    std::memcpy(&mean, &mean_bits, sizeof(mean));
+                    mean = (float) (mean + (value - mean) / visit_cnt); // round once, not twice
+                    if (bits_.compare_exchange_weak(bits, pack(visit_cnt, mean)))
+                        return;
+                }
+            }
+
+            std::uint32_t getVisitCnt() const
+            {
+                return load().visit_cnt;
+            }
+
+            double getQ() const
+            {
+                return load().getQ();
+            }
+
+            void reset()
+            {
+                bits_.store(0);
+            }
+        };
+        static_assert(sizeof(PackedStats) == 8, "one atomic word");
+    }
+}
+
+#endif //LIBUCT_PACKED_STATS_HPP
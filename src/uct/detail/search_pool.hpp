@@ -0,0 +1,308 @@
+//
+// Created by lz on 1/24/17.
+//
+
+#ifndef LIBUCT_SEARCH_POOL_HPP
+#define LIBUCT_SEARCH_POOL_HPP
+
+#include <logger.hpp>
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace uct
+{
+    namespace detail
+    {
+        // Where SearchThreadPool puts its workers
+        enum class ThreadPinning
+        {
+            NONE,    // leave placement to the OS
+            COMPACT, // worker i on the i-th CPU, filling a NUMA node before moving to the next
+            SPREAD   // workers dealt round-robin over the NUMA nodes, to use the memory bandwidth of each
+        };
+
+        // CPUs in a sysfs cpulist such as "0-3,8,10-11"
+        inline std::vector<int> parseCpuList(const std::string &list)
+        {
+            std::vector<int> cpus;
+            std::stringstream ss(list);
+            std::string range;
+            while (std::getline(ss, range, ','))
+            {
+                if (range.find_first_of("0123456789") == std::string::npos)
+                    continue;
+                std::size_t dash = range.find('-');
+                int first = std::stoi(range.substr(0, dash));
+                int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+                for (int cpu = first; cpu <= last; ++cpu)
+                    cpus.push_back(cpu);
+            }
+            return cpus;
+        }
+
+        // CPUs of each NUMA node as sysfs reports them; a single node with every CPU where that's unavailable
+        inline std::vector<std::vector<int>> numaNodeCpus()
+        {
+            std::vector<std::vector<int>> nodes;
+            for (int node = 0; ; ++node)
+            {
+                std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+                std::string list;
+                if (!in || !std::getline(in, list))
+                    break;
+                std::vector<int> cpus = parseCpuList(list);
+                if (!cpus.empty())
+                    nodes.push_back(std::move(cpus));
+            }
+            if (nodes.empty())
+            {
+                nodes.emplace_back();
+                for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu)
+                    nodes.back().push_back((int) cpu);
+            }
+            return nodes;
+        }
+
+        // CPU of worker i is order[i % order.size()]; empty for ThreadPinning::NONE
+        inline std::vector<int> pinningOrder(ThreadPinning pinning, const std::vector<std::vector<int>> &nodes)
+        {
+            std::vector<int> order;
+            if (pinning == ThreadPinning::COMPACT)
+                for (const auto &cpus: nodes)
+                    order.insert(order.end(), cpus.begin(), cpus.end());
+            else if (pinning == ThreadPinning::SPREAD)
+                for (std::size_t i = 0; ; ++i)
+                {
+                    bool any = false;
+                    for (const auto &cpus: nodes)
+                        if (i < cpus.size())
+                        {
+                            order.push_back(cpus[i]);
+                            any = true;
+                        }
+                    if (!any)
+                        break;
+                }
+            return order;
+        }
+
+        // Search threads kept alive between searches, so a search doesn't pay for creating threads and starts with
+        // their thread_local state (rollout engines, scratch buffers, arena slabs) warm. One pool may serve many
+        // trees searching at the same time. A batch only starts once all its jobs are running, so start() counts
+        // the workers other batches hold (a pondering tree holds them until it's stopped) and won't queue jobs no
+        // idle worker is left for: they'd never be picked up, and the jobs that were would wait for them forever.
+        //
+        // Pinned workers stay on their CPU, so the memory they touch first (e.g. their arena slabs) is allocated
+        // on its NUMA node.
+        class SearchThreadPool
+        {
+            struct Batch
+            {
+                std::function<void(std::size_t)> job;
+                std::size_t unstarted;
+                std::size_t remaining;
+                std::exception_ptr error; // first exception thrown by a job
+                std::mutex mutex;
+                std::condition_variable started; // all jobs are running
+                std::condition_variable done;
+            };
+
+            const ThreadPinning pinning;
+            const std::vector<int> cpu_order;
+            std::shared_ptr<spdlog::logger> logger = getGlobalLogger();
+
+            std::mutex mutex;
+            std::condition_variable wake;
+            std::deque<std::function<void()>> tasks; // guarded by mutex
+            std::vector<std::thread> workers;
+            std::size_t target_size = 0; // guarded by mutex; workers with a higher index exit
+            std::size_t busy = 0; // guarded by mutex; workers held by started jobs that haven't returned yet
+
+            void pin(std::size_t worker_idx)
+            {
+#if defined(__linux__)
+                if (cpu_order.empty())
+                    return;
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpu_order[worker_idx % cpu_order.size()], &set);
+                if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+                    logger->warn("Failed to pin search worker {} to CPU {}", worker_idx,
+                                 cpu_order[worker_idx % cpu_order.size()]);
+#else
+                (void) worker_idx;
+#endif
+            }
+
+            void worker_loop(std::size_t worker_idx)
+            {
+                pin(worker_idx);
+                for (;;)
+                {
+                    std::function<void()> task;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        wake.wait(lock, [&]() { return worker_idx >= target_size || !tasks.empty(); });
+                        if (worker_idx >= target_size)
+                            return;
+                        task = std::move(tasks.front());
+                        tasks.pop_front();
+                    }
+                    task();
+                }
+            }
+
+            // Start workers until there are size of them; caller holds mutex
+            void grow_locked(std::size_t size)
+            {
+                target_size = std::max(target_size, size);
+                for (std::size_t i = workers.size(); i < size; ++i)
+                    workers.emplace_back(&SearchThreadPool::worker_loop, this, i);
+            }
+
+        public:
+            explicit SearchThreadPool(std::size_t size = 0, ThreadPinning pinning = ThreadPinning::NONE):
+                    pinning(pinning), cpu_order(pinningOrder(pinning, numaNodeCpus()))
+            {
+                resize(size);
+            }
+
+            SearchThreadPool(const SearchThreadPool &) = delete;
+            SearchThreadPool& operator=(const SearchThreadPool &) = delete;
+
+            ~SearchThreadPool()
+            {
+                resize(0);
+            }
+
+            // Start or stop workers until there are size of them; stopped workers finish their current job first.
+            // Not to be called while a run() is in progress.
+            void resize(std::size_t size)
+            {
+                std::vector<std::thread> stopped;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    target_size = size;
+                    while (workers.size() > size)
+                    {
+                        stopped.push_back(std::move(workers.back()));
+                        workers.pop_back();
+                    }
+                    grow_locked(size);
+                }
+                wake.notify_all();
+                for (auto &t: stopped)
+                    t.join();
+                if (!stopped.empty() || size)
+                    logger->debug("Search thread pool resized to {} workers (pinning {})", size, (int) pinning);
+            }
+
+            // Grow to at least size workers
+            void reserve(std::size_t size)
+            {
+                if (this->size() < size)
+                    resize(size);
+            }
+
+            std::size_t size()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                return workers.size();
+            }
+
+            // Jobs handed out by one start()
+            using BatchHandle = std::shared_ptr<Batch>;
+
+            // Start job(0) ... job(n - 1) on n different workers at the same time and return without waiting for
+            // them. Jobs start together: each waits for the others to be picked up, so no worker runs two jobs of one
+            // batch. Needs n idle workers, i.e. not running jobs of other batches; with grow, the pool starts the
+            // workers it lacks, otherwise start() throws.
+            BatchHandle start(std::size_t n, std::function<void(std::size_t)> job, bool grow = false)
+            {
+                auto batch = std::make_shared<Batch>();
+                batch->job = std::move(job);
+                batch->unstarted = batch->remaining = n;
+                if (!n)
+                    return batch;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (n > workers.size() - busy)
+                    {
+                        if (!grow)
+                            throw std::invalid_argument("SearchThreadPool::start needs as many idle workers as jobs");
+                        grow_locked(busy + n);
+                    }
+                    busy += n;
+                    for (std::size_t i = 0; i < n; ++i)
+                        tasks.emplace_back([this, batch, i]() {
+                            {
+                                std::unique_lock<std::mutex> lock(batch->mutex);
+                                if (--batch->unstarted == 0)
+                                    batch->started.notify_all();
+                                else
+                                    batch->started.wait(lock, [&]() { return batch->unstarted == 0; });
+                            }
+                            std::exception_ptr error;
+                            try {
+                                batch->job(i);
+                            } catch (...)
+                            {
+                                error = std::current_exception();
+                            }
+                            {
+                                std::lock_guard<std::mutex> lock(mutex);
+                                --busy; // before waking wait(), so the next start() finds the worker idle
+                            }
+                            std::lock_guard<std::mutex> lock(batch->mutex);
+                            if (error && !batch->error)
+                                batch->error = error;
+                            if (--batch->remaining == 0)
+                                batch->done.notify_all();
+                        });
+                }
+                wake.notify_all();
+                return batch;
+            }
+
+            // Wait until every job of batch has returned; rethrows the first exception one of them threw
+            void wait(const BatchHandle &batch)
+            {
+                std::unique_lock<std::mutex> lock(batch->mutex);
+                batch->done.wait(lock, [&]() { return batch->remaining == 0; });
+                if (batch->error)
+                    std::rethrow_exception(batch->error);
+            }
+
+            // Whether every job of batch has returned, without waiting
+            bool finished(const BatchHandle &batch)
+            {
+                std::lock_guard<std::mutex> lock(batch->mutex);
+                return batch->remaining == 0;
+            }
+
+            // start() and wait()
+            void run(std::size_t n, std::function<void(std::size_t)> job, bool grow = false)
+            {
+                wait(start(n, std::move(job), grow));
+            }
+        };
+    }
+}
+
+#endif //LIBUCT_SEARCH_POOL_HPP
@@ -0,0 +1,176 @@
+//
+// Created by lz on 1/16/17.
+//
+
+#ifndef LIBUCT_TRANSPOSITION_HPP
+#define LIBUCT_TRANSPOSITION_HPP
+
+#include "packed_stats.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace uct
+{
+    namespace detail
+    {
+        // One slot of a TranspositionTable. Slots live as long as the table, so nodes may keep a pointer to one;
+        // since a slot can be taken over by another position, check `key` before trusting the statistics.
+        template<typename ValueT>
+        struct TranspositionEntry
+        {
+            std::atomic<std::uint64_t> key {0}; // 0: empty
+            std::atomic<std::uint32_t> hit_cnt {0};
+            PackedStats stats; // shared over every node of this position
+            ValueT value; // guarded by the table's stripe lock
+
+            void addStats(double newQ)
+            {
+                stats.add(newQ);
+            }
+        };
+
+        struct TranspositionStats
+        {
+            std::size_t lookup_cnt = 0;
+            std::size_t hit_cnt = 0;
+            std::size_t store_cnt = 0;
+            std::size_t replace_cnt = 0; // stores that evicted another position
+
+            double hitRate() const
+            {
+                return lookup_cnt ? (double) hit_cnt / lookup_cnt : 0.0;
+            }
+        };
+
+        // Fixed-size hash table from position keys (e.g. Zobrist hashes) to ValueT. Slots are grouped in buckets of
+        // two; a store to a full bucket evicts the slot with fewer hits. Buckets are protected by a fixed set of
+        // striped mutexes, so memory stays bounded and threads rarely contend.
+        template<typename ValueT>
+        class TranspositionTable
+        {
+        public:
+            using EntryType = TranspositionEntry<ValueT>;
+            static const std::size_t WAYS = 2;
+        private:
+            static const std::size_t STRIPES = 64;
+
+            const std::size_t bucket_mask;
+            std::unique_ptr<EntryType[]> entries;
+            std::mutex stripes[STRIPES];
+
+            std::atomic<std::size_t> lookup_cnt {0};
+            std::atomic<std::size_t> hit_cnt {0};
+            std::atomic<std::size_t> store_cnt {0};
+            std::atomic<std::size_t> replace_cnt {0};
+
+            static std::size_t round_pow2(std::size_t n)
+            {
+                std::size_t p = 1;
+                while (p < n)
+                    p <<= 1;
+                return p;
+            }
+
+            static std::uint64_t nonzero(std::uint64_t key)
+            {
+                return key ? key : 1;
+            }
+
+            EntryType *bucket(std::uint64_t key)
+            {
+                return &entries[(key & bucket_mask) * WAYS];
+            }
+
+            std::mutex &stripe(std::uint64_t key)
+            {
+                return stripes[(key & bucket_mask) % STRIPES];
+            }
+        public:
+            // capacity: number of slots, rounded up to a power of two
+            explicit TranspositionTable(std::size_t capacity):
+                    bucket_mask(round_pow2((capacity + WAYS - 1) / WAYS) - 1),
+                    entries(new EntryType[(bucket_mask + 1) * WAYS])
+            {}
+
+            TranspositionTable(const TranspositionTable &) = delete;
+            TranspositionTable& operator=(const TranspositionTable &) = delete;
+
+            // On a hit, copy the stored value to out and return its slot; nullptr on a miss
+            EntryType *lookup(std::uint64_t key, ValueT &out)
+            {
+                key = nonzero(key);
+                lookup_cnt.fetch_add(1, std::memory_order_relaxed);
+                std::lock_guard<std::mutex> lock(stripe(key));
+                EntryType *b = bucket(key);
+                for (std::size_t i=0; i<WAYS; ++i)
+                    if (b[i].key.load() == key)
+                    {
+                        b[i].hit_cnt.fetch_add(1);
+                        hit_cnt.fetch_add(1, std::memory_order_relaxed);
+                        out = b[i].value;
+                        return &b[i];
+                    }
+                return nullptr;
+            }
+
+            // Store value for key and return its slot
+            EntryType *store(std::uint64_t key, const ValueT &value)
+            {
+                key = nonzero(key);
+                store_cnt.fetch_add(1, std::memory_order_relaxed);
+                std::lock_guard<std::mutex> lock(stripe(key));
+                EntryType *b = bucket(key);
+                EntryType *victim = &b[0];
+                for (std::size_t i=0; i<WAYS; ++i)
+                {
+                    std::uint64_t k = b[i].key.load();
+                    if (k == key || !k)
+                    {
+                        victim = &b[i];
+                        break;
+                    }
+                    if (b[i].hit_cnt.load() < victim->hit_cnt.load())
+                        victim = &b[i];
+                }
+                if (victim->key.load() != key)
+                {
+                    if (victim->key.load())
+                        replace_cnt.fetch_add(1, std::memory_order_relaxed);
+                    victim->key.store(0); // readers of the old position stop trusting the stats
+                    victim->hit_cnt.store(0);
+                    victim->stats.reset();
+                }
+                victim->value = value;
+                victim->key.store(key);
+                return victim;
+            }
+
+            // Whether slot still holds key (for nodes that kept a slot pointer)
+            static bool holds(const EntryType *slot, std::uint64_t key)
+            {
+                return slot && slot->key.load(std::memory_order_relaxed) == nonzero(key);
+            }
+
+            std::size_t capacity() const
+            {
+                return (bucket_mask + 1) * WAYS;
+            }
+
+            TranspositionStats getStats() const
+            {
+                TranspositionStats stats;
+                stats.lookup_cnt = lookup_cnt.load();
+                stats.hit_cnt = hit_cnt.load();
+                stats.store_cnt = store_cnt.load();
+                stats.replace_cnt = replace_cnt.load();
+                return stats;
+            }
+        };
+    }
+}
+
+#endif //LIBUCT_TRANSPOSITION_HPP
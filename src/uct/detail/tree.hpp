@@ -6,8 +6,11 @@
 #define LIBUCT_TREE_HPP_HPP
 
 #include <logger.hpp>
+#include "arena.hpp"
+#include "search_pool.hpp"
 
 #include <vector>
+#include <algorithm>
 #include <functional>
 #include <memory>
 #include <chrono>
@@ -16,20 +19,30 @@
 #include <atomic>
 #include <cassert>
 #include <fstream>
+#include <stdexcept>
 #include <string>
 #include <queue>
-#include <boost/pool/pool_alloc.hpp>
+#include <future>
+#include <type_traits>
+#include <utility>
 
 namespace uct
 {
+    struct EmptyTreeEdge {};
+
     namespace detail
     {
-        template<typename T, std::size_t ch_buf_size>
+        // A node's block is its cold data; its EdgeT (the hot statistics read when selecting among siblings) lives
+        // in the parent's ChildArray, packed with the sibling edges. The root's edge is owned by the Tree.
+        template<typename T, std::size_t ch_buf_size, typename EdgeT = EmptyTreeEdge>
         struct TreeNodeWithBlock
         {
         public:
+            using EdgeType = EdgeT;
+
             TreeNodeWithBlock *parent;
-            std::vector<TreeNodeWithBlock> ch;
+            EdgeT *edge = nullptr; // set when the node is created in its parent, or by the Tree for the root
+            ChildArray<TreeNodeWithBlock, EdgeT> ch; // allocated on expansion, ch_buf_size children by default
             T block;
 
 
@@ -37,13 +50,70 @@ namespace uct
             TreeNodeWithBlock(TreeNodeWithBlock *parentP, Us&& ...us):
                     parent(parentP), block(std::forward<Us>(us)...)
             {
-                ch.reserve(ch_buf_size);
             }
 
             TreeNodeWithBlock():
                     TreeNodeWithBlock(nullptr)
             {
-                ch.reserve(ch_buf_size);
+            }
+
+            TreeNodeWithBlock(const TreeNodeWithBlock &other):
+                    parent(other.parent), edge(other.edge), ch(other.ch), block(other.block)
+            {
+            }
+
+            // Takes over other's children, which are re-parented to this node
+            TreeNodeWithBlock(TreeNodeWithBlock &&other):
+                    parent(other.parent), edge(other.edge), ch(std::move(other.ch)), block(std::move(other.block))
+            {
+                for (auto &c: ch)
+                    c.parent = this;
+            }
+
+            // Append a child constructed from us... (the parent pointer is filled in); safe to call concurrently
+            template<typename ... Us>
+            TreeNodeWithBlock &emplace_child(NodeArena &arena, Us&& ...us)
+            {
+                std::size_t index;
+                ch.reserve(arena, ch_buf_size, ch_buf_size);
+                if (!ch.claim(ch_buf_size, index))
+                    throw std::length_error("TreeNodeWithBlock has no free child slot");
+                arena.addNodes(1);
+                return emplace_claimed_child(index, std::forward<Us>(us)...);
+            }
+
+            // Two-step lock-free expansion, for policies that pick the child from its index: claim the next index
+            // below limit, then construct that child with emplace_claimed_child. The node holds at most capacity
+            // children (instead of ch_buf_size), and its child range grows with limit; every claim must pass the
+            // same capacity.
+            bool claim_child(NodeArena &arena, std::size_t capacity, std::size_t limit, std::size_t &index)
+            {
+                limit = std::min(limit, capacity);
+                if (limit == 0 || ch.size() >= limit)
+                    return false;
+                ch.reserve(arena, capacity, limit);
+                if (!ch.claim(limit, index))
+                    return false;
+                arena.addNodes(1);
+                return true;
+            }
+
+            template<typename ... Us>
+            TreeNodeWithBlock &emplace_claimed_child(std::size_t index, Us&& ...us)
+            {
+                TreeNodeWithBlock &child = ch.construct(index, this, std::forward<Us>(us)...);
+                if (!std::is_empty<EdgeT>::value)
+                    child.edge = &ch.edge(index);
+                return ch.publish(index);
+            }
+
+            // Destroy the descendants and give their child ranges back to the arena, leaving a leaf. Not while
+            // other threads may walk the subtree.
+            void release_children(NodeArena &arena)
+            {
+                for (auto &c: ch)
+                    c.release_children(arena);
+                ch.release(arena);
             }
         };
 
@@ -52,18 +122,94 @@ namespace uct
 
     struct EmptyTreeBlock {};
 
+    // When a search ends. A search stops at the first limit it hits, or when Tree::stop() is called.
+    struct SearchLimits
+    {
+        // Planned search time; by default the search runs until stopped, e.g. while pondering
+        std::chrono::milliseconds time_limit = std::chrono::milliseconds::max();
+        // Keep searching past time_limit, up to max_time, while the second most visited root child has at least
+        // extend_ratio of the visits of the first; never extends unless max_time > time_limit
+        std::chrono::milliseconds max_time {0};
+        double extend_ratio = 0.8;
+        // Stop as soon as the most visited root child can't be overtaken in the rest of time_limit at the playout
+        // rate so far. Early stop and extension need the policy to define
+        //     visit count getVisitCount(const TreeNodeType &) const
+        // and to pick the most visited root child in getFinalResultIndex.
+        bool early_stop = true;
+        std::size_t max_playouts = 0; // iterations that reached default_policy, 0 for no limit; exact with one thread
+        std::size_t max_nodes = 0; // nodes in the tree, 0 for no limit; waits for advance() to free the old tree
+        // Longest time between two clock reads of a search thread, not counting the iteration in progress
+        std::chrono::milliseconds check_latency {1};
+    };
+
     template<typename PolicyT>
     class Tree;
 
-    template<typename AdditionalBlockT, std::size_t ch_buf_size, typename TreeStateT = EmptyTreeBlock>
-    struct TreePolicy
+    namespace detail
+    {
+        // Whether PolicyT has getVisitCount(const TreeNodeType &), for SearchLimits::early_stop
+        template<typename PolicyT, typename = void>
+        struct HasVisitCount: std::false_type {};
+
+        template<typename PolicyT>
+        struct HasVisitCount<PolicyT, decltype((void) std::declval<const PolicyT &>().getVisitCount(
+                std::declval<const typename PolicyT::TreeNodeType &>()))>: std::true_type {};
+
+        static const std::size_t NO_SEARCH_THREAD = (std::size_t) -1;
+
+        // Index (0 .. thread_num - 1) of the search job the calling thread runs, NO_SEARCH_THREAD outside a search.
+        // Whichever pool worker picks up job i, it sees i, so policies can key per-thread state such as RNG streams
+        // on it and replay a search from the same seed.
+        inline std::size_t &searchThreadIndex()
+        {
+            static thread_local std::size_t index = NO_SEARCH_THREAD;
+            return index;
+        }
+    }
+
+    // Compile-time tree policy. Derive from it and define, without virtual:
+    //     TreePolicyResult tree_policy(TreeNodeType *root);
+    //     void default_policy(const TreePolicyResult &);
+    //     std::size_t getFinalResultIndex(TreeNodeType *root);
+    //     TreeNodeType getRoot();
+    // with the meaning documented in TreePolicy. Tree calls them on the concrete policy type, so they can be inlined
+    // into its search loop.
+    template<typename AdditionalBlockT, std::size_t ch_buf_size, typename TreeStateT = EmptyTreeBlock,
+            typename EdgeT = EmptyTreeEdge>
+    struct StaticTreePolicy
     {
-        using TreeType = Tree<TreePolicy>;
         using BlockType = AdditionalBlockT;
-        using TreeNodeType = detail::TreeNodeWithBlock<AdditionalBlockT, ch_buf_size>;
+        using EdgeType = EdgeT;
+        using TreeNodeType = detail::TreeNodeWithBlock<AdditionalBlockT, ch_buf_size, EdgeT>;
         using TreeState = TreeStateT;
         // New expanded leaf + extra information
         using TreePolicyResult = std::pair<TreeNodeType*, TreeState>;
+
+        // Called by Tree::run before its threads start, with the time they will stop at, and after they all joined
+        void onSearchBegin(std::chrono::steady_clock::time_point) {}
+        void onSearchEnd() {}
+        // Called once per search by the thread that asks it to stop (a search thread hitting a limit, or
+        // Tree::stop), while the other search threads may still be running
+        void onStopRequested() {}
+
+        // Set by Tree before the first tree_policy call; expand nodes with node->emplace_child(*node_arena, ...) or
+        // claim_child/emplace_claimed_child, both lock-free
+        detail::NodeArena *node_arena = nullptr;
+
+        static const std::size_t CH_BUF_SIZE = ch_buf_size;
+    };
+
+    // Tree policy with virtual hooks, for callers that want runtime polymorphism. Tree itself still calls the
+    // overrides of the policy type it holds directly. The search hooks (onSearchBegin, ...) stay non-virtual, as
+    // Tree never calls them through a base; hide them in the derived policy to use them.
+    template<typename AdditionalBlockT, std::size_t ch_buf_size, typename TreeStateT = EmptyTreeBlock,
+            typename EdgeT = EmptyTreeEdge>
+    struct TreePolicy: StaticTreePolicy<AdditionalBlockT, ch_buf_size, TreeStateT, EdgeT>
+    {
+        using BaseT = StaticTreePolicy<AdditionalBlockT, ch_buf_size, TreeStateT, EdgeT>;
+        using TreeType = Tree<TreePolicy>;
+        using TreeNodeType = typename BaseT::TreeNodeType;
+        using TreePolicyResult = typename BaseT::TreePolicyResult;
         // From root, return expanded new leaf on success(then default_policy will be called),
         // otherwise return nullptr(tree_policy will be called again)
         virtual TreePolicyResult tree_policy(TreeNodeType *root) = 0;
@@ -75,8 +221,6 @@ namespace uct
         virtual TreeNodeType getRoot() = 0;
 
         virtual ~TreePolicy() {}
-
-        static const std::size_t CH_BUF_SIZE = ch_buf_size;
     };
 
     template<typename PolicyT>
@@ -88,90 +232,430 @@ namespace uct
         using PolicyType = PolicyT;
         using TreeNodeType = typename PolicyType::TreeNodeType;
         using TreeState = typename PolicyType::TreeState;
+        using EdgeType = typename TreeNodeType::EdgeType;
     protected:
-        PolicyType policy;
+        PolicyType policy; // called as policy.PolicyType::f(), so even TreePolicy overrides are bound statically
+        detail::NodeArena arena_; // owns every node but the root; must outlive root_
+        EdgeType root_edge_ {}; // the root's edge, as it has no parent to keep it
         std::unique_ptr<TreeNodeType> root_;
         std::shared_ptr<spdlog::logger> plogger_;
+        std::atomic<std::size_t> iteration_cnt_ {0};
+        std::atomic<std::size_t> wasted_cnt_ {0}; // iterations where tree_policy returned nullptr
+        std::future<void> reclaim_; // frees subtrees dropped by advance(); declared after arena_ so it ends first
+        std::shared_ptr<detail::SearchThreadPool> pool_; // runs the search threads; created by the first search
+        detail::SearchThreadPool::BatchHandle search_; // the running search, if any
+        std::atomic_bool stop_requested_ {false}; // checked by the search threads on every iteration
+
+        // State of the running search, reset by startSearch
+        SearchLimits limits_;
+        std::chrono::steady_clock::time_point search_start_;
+        std::atomic<std::size_t> search_iteration_cnt_ {0}; // flushed by the threads at their clock reads
+        std::atomic<std::size_t> search_playout_cnt_ {0}; // playouts claimed, for SearchLimits::max_playouts
+        std::atomic<std::chrono::steady_clock::rep> next_root_check_ {0}; // when early stop looks at the root again
     public:
 
         template<typename ... Us>
         Tree(Us&& ...us):
                 policy(std::forward<Us>(us)...),
-                root_(new TreeNodeType(policy.getRoot())), plogger_(getGlobalLogger())
+                root_(new TreeNodeType(policy.PolicyType::getRoot())), plogger_(getGlobalLogger())
         {
-            policy.default_policy(std::make_pair(root_.get(), TreeState {}));
+            root_->edge = &root_edge_;
+            policy.node_arena = &arena_;
+            policy.PolicyType::default_policy(std::make_pair(root_.get(), TreeState {}));
             plogger_->trace("Tree established with root at {} ", (void*)this);
         }
 
+        Tree(const Tree &) = delete;
+        Tree& operator=(const Tree &) = delete;
+
+        ~Tree()
+        {
+            try {
+                stop();
+            } catch (const std::exception &e)
+            {
+                plogger_->error("Search ended with an exception: {}", e.what());
+            }
+        }
+
+        // Search for time_limit_ms with thread_num threads, blocking until done
         void run(std::size_t thread_num, std::chrono::milliseconds time_limit_ms);
 
+        // Search with thread_num threads until limits says to stop, blocking until done
+        void run(std::size_t thread_num, const SearchLimits &limits);
+
+        // Start searching from the current root and return at once; the search ends after time_limit_ms, by
+        // default only when stopped. Use it to ponder on the opponent's time: advance() with their move keeps the
+        // matching subtree. Throws std::logic_error if a search is already running. startSearch, stop,
+        // waitResult and advance are meant to be called from one controlling thread.
+        void startSearch(std::size_t thread_num,
+                         std::chrono::milliseconds time_limit_ms = std::chrono::milliseconds::max());
+
+        // Like startSearch above, with time management, early stop and playout/node budgets
+        void startSearch(std::size_t thread_num, const SearchLimits &limits);
+
+        // Ask the running search to stop and wait for its threads to return; does nothing without one. Rethrows
+        // an exception a search thread threw. The policy's onStopRequested should cut short whatever a thread
+        // may block on, as UCTTreePolicy does with its CNN calls, or this waits for it.
+        void stop();
+
+        // Wait for the running search to reach its time limit (without stopping it early), then suggest a child of
+        // the root as getResultNode does
+        TreeNodeType *waitResult();
+
+        // Whether search threads are still running. A search that reached one of its limits is over, though it
+        // still needs stop() or waitResult() before the next startSearch.
+        bool isSearching() const
+        {
+            return search_ && !pool_->finished(search_);
+        }
+
+        // Search on pool's workers from now on, e.g. to share them with other trees or to pin them to CPUs.
+        // Without one, the tree makes its own unpinned pool on the first search. Not while searching.
+        void setThreadPool(std::shared_ptr<detail::SearchThreadPool> pool)
+        {
+            pool_ = std::move(pool);
+        }
+
+        const std::shared_ptr<detail::SearchThreadPool> &getThreadPool() const
+        {
+            return pool_;
+        }
+
+        // Play action from the current root. The matching child becomes the new root with its statistics kept,
+        // and the rest of the old tree is freed in the background. Call once per move (ours, then the opponent's).
+        // Needs policy.isChildAction(const TreeNodeType&, const ActionT&) and policy.advanceRoot(const ActionT&).
+        // Returns whether a subtree was reused; otherwise the search restarts from a fresh root.
+        // Stops a running search (e.g. pondering) first.
+        template<typename ActionT>
+        bool advance(const ActionT &action);
+
         TreeNodeType *getResultNode()
         {
-            std::size_t resultIndex = policy.getFinalResultIndex(root_.get());
             if (root_->ch.empty())
                 return nullptr;
             else
-                return &root_->ch[policy.getFinalResultIndex(root_.get())];
+                return &root_->ch[policy.PolicyType::getFinalResultIndex(root_.get())];
         }
 
         void dumpToDotFile(const std::string &filename);
 
+        TreeNodeType *getRootNode()
+        {
+            return root_.get();
+        }
+
+        PolicyType &getPolicy()
+        {
+            return policy;
+        }
+
+        // Iterations run by all threads over every run() so far
+        std::size_t getIterationCount() const
+        {
+            return iteration_cnt_.load();
+        }
+
+        // Iterations of the running or last search, as of the search threads' last clock reads (about every
+        // SearchLimits::check_latency)
+        std::size_t getSearchIterationCount() const
+        {
+            return search_iteration_cnt_.load(std::memory_order_relaxed);
+        }
+
+        // Iterations that expanded nothing, e.g. because another thread got to the same leaf first
+        std::size_t getWastedIterationCount() const
+        {
+            return wasted_cnt_.load();
+        }
+
     protected:
-        void single_thread_runner(std::chrono::milliseconds time_limit_ms, TreeNodeType *root_node);
+        // Destroy node's descendants and give their child ranges back to the arena
+        void releaseSubtree(TreeNodeType *node);
+
+        void single_thread_runner(TreeNodeType *root_node);
+
+        // Why the search should end at now, or nullptr to go on. Called by every thread at each clock read.
+        const char *stopReason(std::chrono::steady_clock::time_point now);
+
+        // Visits of the two most visited root children; zeros if the policy can't tell
+        void topRootVisits(double &best, double &second, std::true_type) const;
+        void topRootVisits(double &best, double &second, std::false_type) const
+        {
+            best = second = 0;
+        }
+
+        // Wait for the search threads and close the search
+        void finishSearch();
     };
 
     template<typename PolicyT>
-    void Tree<PolicyT>::single_thread_runner(std::chrono::milliseconds time_limit_ms, TreeNodeType *root_node)
+    void Tree<PolicyT>::single_thread_runner(TreeNodeType *root_node)
     {
-        static constexpr std::size_t TIME_CHECK_CNT_INTEVAL = 100;
-        std::size_t cnt = 0;
-        auto start_time = std::chrono::steady_clock::now();
-        plogger_->debug("[tid={}] New Tree thread created with CHECK_INTEVAL={}, root={}",
-                        std::this_thread::get_id(), TIME_CHECK_CNT_INTEVAL, (void*)root_node);
+        using Clock = std::chrono::steady_clock;
+        static constexpr std::size_t MAX_CHECK_INTERVAL = 100; // iterations between clock reads, at most
+        const bool count_playouts = limits_.max_playouts > 0;
+        std::size_t cnt = 0, wasted_cnt = 0;
+        auto start_time = Clock::now();
+        plogger_->debug("[tid={}] New Tree thread created with check latency {}ms, root={}",
+                        std::this_thread::get_id(), limits_.check_latency.count(), (void*)root_node);
 
         try {
-            std::size_t cnt_since_last_check = 0;
+            // Iterations between clock reads adapt to their cost, so the clock is read about every check_latency
+            // whether an iteration takes a microsecond or a CNN round trip
+            std::size_t check_interval = 1, cnt_since_last_check = 0;
+            auto last_check = start_time;
 
             for (;;) {
+                if (stop_requested_.load(std::memory_order_relaxed))
+                    break;
+                if (count_playouts && search_playout_cnt_.fetch_add(1) >= limits_.max_playouts) {
+                    if (!stop_requested_.exchange(true)) {
+                        plogger_->debug("Search stopped: playout budget of {} spent", limits_.max_playouts);
+                        policy.PolicyType::onStopRequested();
+                    }
+                    break;
+                }
                 ++cnt;
                 ++cnt_since_last_check;
-                if (cnt_since_last_check >= TIME_CHECK_CNT_INTEVAL) {
-                    auto cur_time = std::chrono::steady_clock::now();
-                    if (std::chrono::duration_cast<std::chrono::milliseconds>(cur_time - start_time) > time_limit_ms)
-                        break;
-                    cnt_since_last_check = 0;
-                }
 
-                std::pair<TreeNodeType *, TreeState> tree_policy_result = policy.tree_policy(root_.get());
+                std::pair<TreeNodeType *, TreeState> tree_policy_result = policy.PolicyType::tree_policy(root_.get());
                 if (tree_policy_result.first) {
-                    policy.default_policy(tree_policy_result);
+                    policy.PolicyType::default_policy(tree_policy_result);
+                } else {
+                    ++wasted_cnt;
+                    if (count_playouts)
+                        search_playout_cnt_.fetch_sub(1); // no playout after all
+                }
+
+                if (cnt_since_last_check >= check_interval) {
+                    auto cur_time = Clock::now();
+                    std::chrono::duration<double> took = cur_time - last_check;
+                    std::chrono::duration<double> latency = limits_.check_latency;
+                    double per_latency = took.count() > 0 ?
+                                         cnt_since_last_check * latency.count() / took.count() : MAX_CHECK_INTERVAL;
+                    check_interval = (std::size_t) std::max(1.0, std::min<double>(MAX_CHECK_INTERVAL, per_latency));
+                    search_iteration_cnt_.fetch_add(cnt_since_last_check, std::memory_order_relaxed);
+                    cnt_since_last_check = 0;
+                    last_check = cur_time;
+                    if (const char *reason = stopReason(cur_time)) {
+                        if (!stop_requested_.exchange(true)) {
+                            plogger_->debug("Search stopped: {}", reason);
+                            policy.PolicyType::onStopRequested();
+                        }
+                        break;
+                    }
                 }
             }
-            auto cur_time = std::chrono::steady_clock::now();
-            plogger_->debug("[tid={}] Tree thread finished! cnt={} time_eclipsed: {}ms",
-                            std::this_thread::get_id(), cnt, std::chrono::duration_cast<std::chrono::milliseconds>(
+            iteration_cnt_.fetch_add(cnt);
+            wasted_cnt_.fetch_add(wasted_cnt);
+            auto cur_time = Clock::now();
+            plogger_->debug("[tid={}] Tree thread finished! cnt={} wasted={} time_eclipsed: {}ms",
+                            std::this_thread::get_id(), cnt, wasted_cnt,
+                            std::chrono::duration_cast<std::chrono::milliseconds>(
                             cur_time - start_time
                     ).count());
         } catch(const std::exception &e)
         {
             plogger_->critical("[tid={}] thrown an exception: {}", std::this_thread::get_id(), e.what());
-            throw e;
+            throw;
+        }
+    }
+
+    template<typename PolicyT>
+    const char *Tree<PolicyT>::stopReason(std::chrono::steady_clock::time_point now)
+    {
+        // in double milliseconds, as time_limit may be milliseconds::max()
+        const double elapsed = std::chrono::duration<double, std::milli>(now - search_start_).count();
+        const double time_limit = (double) limits_.time_limit.count();
+        const bool can_extend = limits_.max_time > limits_.time_limit;
+        if (elapsed >= std::max(time_limit, (double) limits_.max_time.count()))
+            return can_extend ? "extended time used up" : "time limit reached";
+        if (limits_.max_nodes && arena_.getNodeCount() >= limits_.max_nodes)
+            return "node budget reached";
+
+        using HasVisits = detail::HasVisitCount<PolicyType>;
+        const bool overtime = elapsed >= time_limit;
+        if (!HasVisits::value || (overtime && !can_extend))
+            return overtime ? "time limit reached" : nullptr;
+        if (!overtime && !limits_.early_stop)
+            return nullptr;
+
+        // Only one thread per check_latency looks at the root children
+        auto next = next_root_check_.load(std::memory_order_relaxed);
+        if (now.time_since_epoch().count() < next ||
+            !next_root_check_.compare_exchange_strong(next, (now + limits_.check_latency).time_since_epoch().count()))
+            return nullptr;
+        double best, second;
+        topRootVisits(best, second, HasVisits());
+        if (overtime)
+            return best > 0 && second >= limits_.extend_ratio * best ? nullptr : "time limit reached, no close call";
+
+        // Playouts the rest of the planned time is good for, at the rate so far
+        double remaining = elapsed > 0 ? search_iteration_cnt_.load() / elapsed * (time_limit - elapsed) : time_limit;
+        if (limits_.max_playouts)
+        {
+            std::size_t claimed = search_playout_cnt_.load();
+            remaining = std::min(remaining, (double) (limits_.max_playouts - std::min(claimed, limits_.max_playouts)));
+        }
+        return best - second > remaining ? "the leading root child can't be overtaken" : nullptr;
+    }
+
+    template<typename PolicyT>
+    void Tree<PolicyT>::topRootVisits(double &best, double &second, std::true_type) const
+    {
+        best = second = 0;
+        for (const auto &c: root_->ch)
+        {
+            double visits = (double) policy.PolicyType::getVisitCount(c);
+            if (visits > best)
+            {
+                second = best;
+                best = visits;
+            } else if (visits > second)
+                second = visits;
         }
     }
 
     template<typename PolicyT>
     void Tree<PolicyT>::run(std::size_t thread_num, std::chrono::milliseconds time_limit_ms)
     {
-        plogger_->debug("Start to run Tree & default policy with time limit {}ms and {} threads",
-                        time_limit_ms.count(), thread_num);
-        std::vector<std::thread> threads;
-        for (std::size_t i=0; i<thread_num; ++i)
-            threads.emplace_back(&Tree::single_thread_runner, this, time_limit_ms, root_.get());
-        std::for_each(threads.begin(), threads.end(), [](std::thread &t) {
-            if (t.joinable())
-                t.join();
+        startSearch(thread_num, time_limit_ms);
+        finishSearch();
+    }
+
+    template<typename PolicyT>
+    void Tree<PolicyT>::run(std::size_t thread_num, const SearchLimits &limits)
+    {
+        startSearch(thread_num, limits);
+        finishSearch();
+    }
+
+    template<typename PolicyT>
+    void Tree<PolicyT>::startSearch(std::size_t thread_num, std::chrono::milliseconds time_limit_ms)
+    {
+        SearchLimits limits;
+        limits.time_limit = time_limit_ms;
+        limits.early_stop = false; // use the whole time, as before SearchLimits
+        startSearch(thread_num, limits);
+    }
+
+    template<typename PolicyT>
+    void Tree<PolicyT>::startSearch(std::size_t thread_num, const SearchLimits &limits)
+    {
+        if (search_)
+            throw std::logic_error("Tree::startSearch while a search is running");
+        plogger_->debug("Start to run Tree & default policy with time limit {}ms (up to {}ms), {} playouts, "
+                        "{} nodes and {} threads", limits.time_limit.count(), limits.max_time.count(),
+                        limits.max_playouts, limits.max_nodes, thread_num);
+        if (limits.max_nodes && reclaim_.valid())
+            reclaim_.wait(); // the node count must not include the subtrees advance() is still freeing
+        if (!pool_)
+            pool_ = std::make_shared<detail::SearchThreadPool>(thread_num);
+
+        limits_ = limits;
+        search_start_ = std::chrono::steady_clock::now();
+        search_iteration_cnt_.store(0);
+        search_playout_cnt_.store(0);
+        next_root_check_.store(0);
+        stop_requested_.store(false);
+
+        auto hard_limit = std::max(limits.time_limit, limits.max_time);
+        auto deadline = std::chrono::steady_clock::time_point::max();
+        if (hard_limit < std::chrono::duration_cast<std::chrono::milliseconds>(deadline - search_start_))
+            deadline = search_start_ + hard_limit;
+        policy.PolicyType::onSearchBegin(deadline);
+        TreeNodeType *root_node = root_.get();
+        // The pool grows if other trees keep too many of its workers busy, e.g. while they ponder
+        search_ = pool_->start(thread_num, [this, root_node](std::size_t i) {
+            struct IndexScope
+            {
+                explicit IndexScope(std::size_t i) { detail::searchThreadIndex() = i; }
+                ~IndexScope() { detail::searchThreadIndex() = detail::NO_SEARCH_THREAD; }
+            } scope(i);
+            single_thread_runner(root_node);
+        }, true);
+    }
+
+    template<typename PolicyT>
+    void Tree<PolicyT>::stop()
+    {
+        if (!search_)
+            return;
+        if (!stop_requested_.exchange(true))
+            policy.PolicyType::onStopRequested();
+        finishSearch();
+    }
+
+    template<typename PolicyT>
+    typename Tree<PolicyT>::TreeNodeType *Tree<PolicyT>::waitResult()
+    {
+        finishSearch();
+        return getResultNode();
+    }
+
+    template<typename PolicyT>
+    void Tree<PolicyT>::finishSearch()
+    {
+        if (!search_)
+            return;
+        detail::SearchThreadPool::BatchHandle search = std::move(search_);
+        try {
+            pool_->wait(search);
+        } catch (...)
+        {
+            policy.PolicyType::onSearchEnd();
+            throw;
+        }
+        policy.PolicyType::onSearchEnd();
+        plogger_->debug("Tree & default_policy finished, node arena holds {}KB", arena_.getUsedBytes() / 1024);
+    }
+
+    template<typename PolicyT>
+    template<typename ActionT>
+    bool Tree<PolicyT>::advance(const ActionT &action)
+    {
+        stop();
+        if (reclaim_.valid())
+            reclaim_.wait();
+
+        TreeNodeType *old_root = root_.release();
+        TreeNodeType *matched = nullptr;
+        for (auto &c: old_root->ch)
+            if (policy.isChildAction(c, action))
+            {
+                matched = &c;
+                break;
+            }
+        policy.advanceRoot(action);
+
+        if (matched)
+        {
+            if (matched->edge)
+                root_edge_ = *matched->edge; // its slot goes away with the old root's children
+            root_.reset(new TreeNodeType(std::move(*matched)));
+            root_->parent = nullptr;
+            root_->edge = &root_edge_;
+        } else
+        {
+            root_edge_ = EdgeType();
+            root_.reset(new TreeNodeType(policy.PolicyType::getRoot()));
+            root_->edge = &root_edge_;
+            policy.PolicyType::default_policy(std::make_pair(root_.get(), TreeState {}));
+        }
+        plogger_->debug("Advanced root to {}, subtree reused: {}", (void*)root_.get(), matched != nullptr);
+
+        reclaim_ = std::async(std::launch::async, [this, old_root]() {
+            releaseSubtree(old_root);
+            delete old_root;
         });
-        plogger_->debug("Tree & default_policy finished");
+        return matched != nullptr;
+    }
+
+    template<typename PolicyT>
+    void Tree<PolicyT>::releaseSubtree(TreeNodeType *node)
+    {
+        node->release_children(arena_);
     }
 
     template<typename PolicyT>
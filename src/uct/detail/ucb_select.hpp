@@ -0,0 +1,305 @@
+//
+// Created by lz on 1/22/17.
+//
+
+#ifndef LIBUCT_UCB_SELECT_HPP
+#define LIBUCT_UCB_SELECT_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include "packed_stats.hpp"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace uct
+{
+    namespace detail
+    {
+        // Hot statistics of the move into a node: everything selection reads, packed in 16 bytes and stored with
+        // the sibling edges in the parent's ChildArray (the root's is held by the Tree)
+        struct alignas(16) UCTEdge
+        {
+            // CNN evaluation of the node's good positions. The thread that moves it NONE -> PENDING runs the RPC,
+            // sets the node's pGoodPos and publishes it by the release store of READY.
+            static const std::uint8_t CNN_NONE = 0, CNN_PENDING = 1, CNN_READY = 2;
+
+            PackedStats stats; // visits and mean value of the playouts through the node
+            std::atomic<std::int16_t> virtual_loss_cnt {0}; // threads currently between tree_policy and backup
+            std::atomic<std::uint8_t> cnn_state {CNN_NONE};
+            std::atomic_bool default_policy_done {false};
+            float prior = 0.0f; // CNN probability of the move; written before the child is published
+
+            UCTEdge() = default;
+
+            UCTEdge(const UCTEdge &other)
+            {
+                *this = other;
+            }
+
+            UCTEdge& operator= (const UCTEdge &other)
+            {
+                stats = other.stats;
+                virtual_loss_cnt.store(other.virtual_loss_cnt.load());
+                cnn_state.store(other.cnn_state.load());
+                default_policy_done.store(other.default_policy_done.load());
+                prior = other.prior;
+                return *this;
+            }
+        };
+        static_assert(sizeof(UCTEdge) == 16, "four edges per cache line");
+
+#if defined(__SSE2__)
+        // The edge as the four words select_best transposes: visits, mean, then virtual_loss_cnt, cnn_state and
+        // default_policy_done packed in one (16, 8 and 8 bits from the bottom), then the prior. Each field is read
+        // with its own relaxed load, as other threads update them with atomic operations; a vector load straight
+        // from the edge would race with those. The fields may come from different moments, as in edge_value.
+        inline __m128 load_edge(const UCTEdge &e)
+        {
+            std::uint64_t stats = e.stats.loadBits(std::memory_order_relaxed);
+            std::uint32_t prior_bits;
+            std::memcpy(&prior_bits, &e.prior, 4);
+            std::uint64_t rest = (std::uint16_t) e.virtual_loss_cnt.load(std::memory_order_relaxed) |
+                                 (std::uint64_t) e.cnn_state.load(std::memory_order_relaxed) << 16 |
+                                 (std::uint64_t) e.default_policy_done.load(std::memory_order_relaxed) << 24 |
+                                 (std::uint64_t) prior_bits << 32;
+            return _mm_castsi128_ps(_mm_set_epi64x((long long) rest, (long long) stats));
+        }
+#endif
+
+        // Everything the selection kernels need besides the edges; parent terms are computed once per node
+        struct SelectParams
+        {
+            float exploration; // UCB1: 2 * log(parent visits); PUCT: c_puct * sqrt(parent visits)
+            float virtual_loss; // weight of one in-flight playout: virtual_loss * max(1, ratio * visits)
+            float virtual_loss_ratio; // 0 for a constant weight
+        };
+
+        // Value of a child from its mean value q / visit_cnt, both counting virtual losses as lost playouts.
+        // Overloaded for scalars and for SSE2 / AVX2 vectors.
+        struct UCB1Score
+        {
+            static float value(float q, float visit_cnt, float, float exploration)
+            {
+                return q / visit_cnt + 0.5f * std::sqrt(exploration / visit_cnt);
+            }
+#if defined(__SSE2__)
+            static __m128 value(__m128 q, __m128 visit_cnt, __m128, __m128 exploration)
+            {
+                return _mm_add_ps(_mm_div_ps(q, visit_cnt),
+                                  _mm_mul_ps(_mm_set1_ps(0.5f), _mm_sqrt_ps(_mm_div_ps(exploration, visit_cnt))));
+            }
+#endif
+#if defined(__AVX2__)
+            static __m256 value(__m256 q, __m256 visit_cnt, __m256, __m256 exploration)
+            {
+                return _mm256_add_ps(_mm256_div_ps(q, visit_cnt), _mm256_mul_ps(_mm256_set1_ps(0.5f),
+                                     _mm256_sqrt_ps(_mm256_div_ps(exploration, visit_cnt))));
+            }
+#endif
+        };
+
+        // AlphaGo's PUCT: the prior shares out the exploration bonus, which decays as 1 / (1 + visits)
+        struct PUCTScore
+        {
+            static float value(float q, float visit_cnt, float prior, float exploration)
+            {
+                return q / visit_cnt + exploration * prior / (1.0f + visit_cnt);
+            }
+#if defined(__SSE2__)
+            static __m128 value(__m128 q, __m128 visit_cnt, __m128 prior, __m128 exploration)
+            {
+                return _mm_add_ps(_mm_div_ps(q, visit_cnt), _mm_div_ps(_mm_mul_ps(exploration, prior),
+                                                                       _mm_add_ps(_mm_set1_ps(1.0f), visit_cnt)));
+            }
+#endif
+#if defined(__AVX2__)
+            static __m256 value(__m256 q, __m256 visit_cnt, __m256 prior, __m256 exploration)
+            {
+                return _mm256_add_ps(_mm256_div_ps(q, visit_cnt), _mm256_div_ps(
+                        _mm256_mul_ps(exploration, prior), _mm256_add_ps(_mm256_set1_ps(1.0f), visit_cnt)));
+            }
+#endif
+        };
+
+        // Score of one edge, as select_best computes it: -1 before its first playout is backed up, lowest while its
+        // CNN evaluation is in flight (we'd only bail out there)
+        template<typename ScoreT>
+        inline float edge_value(const UCTEdge &e, const SelectParams &p)
+        {
+            if (e.cnn_state.load(std::memory_order_relaxed) == UCTEdge::CNN_PENDING)
+                return std::numeric_limits<float>::lowest();
+            if (!e.default_policy_done.load(std::memory_order_relaxed))
+                return -1.0f;
+            PackedStats::Snapshot stats = e.stats.load(std::memory_order_relaxed);
+            float visit_cnt = (float) stats.visit_cnt;
+            float q = stats.mean * visit_cnt;
+            int pending = e.virtual_loss_cnt.load(std::memory_order_relaxed);
+            if (pending > 0)
+            {
+                float loss = pending * p.virtual_loss * std::max(1.0f, p.virtual_loss_ratio * visit_cnt);
+                visit_cnt += loss;
+                q -= loss;
+            }
+            return ScoreT::value(q, visit_cnt, e.prior, p.exploration);
+        }
+
+        inline float ucb_value(const UCTEdge &e, const SelectParams &p)
+        {
+            return edge_value<UCB1Score>(e, p);
+        }
+
+        inline float puct_value(const UCTEdge &e, const SelectParams &p)
+        {
+            return edge_value<PUCTScore>(e, p);
+        }
+
+        // Index of the first edge of edges[0, n) with the highest edge_value, which goes to best_val; n must be
+        // positive. Four (SSE2) or eight (AVX2) edges are read by load_edge and transposed in registers into
+        // visits, mean, flags and prior vectors; the rest goes through edge_value.
+        // Visits and mean come from one stats snapshot, as in the scalar path. Visits are taken as signed.
+        template<typename ScoreT>
+        inline std::size_t select_best(const UCTEdge *edges, std::size_t n, const SelectParams &p, float &best_val)
+        {
+            std::size_t i = 0, best = 0;
+            best_val = -std::numeric_limits<float>::infinity();
+#if defined(__AVX2__)
+            if (n >= 8)
+            {
+                const __m256 one = _mm256_set1_ps(1.0f);
+                const __m256 zero = _mm256_setzero_ps(), exploration = _mm256_set1_ps(p.exploration);
+                const __m256 vl = _mm256_set1_ps(p.virtual_loss), vl_ratio = _mm256_set1_ps(p.virtual_loss_ratio);
+                const __m256 undone_val = _mm256_set1_ps(-1.0f);
+                const __m256 pending_val = _mm256_set1_ps(std::numeric_limits<float>::lowest());
+                const __m256i byte_mask = _mm256_set1_epi32(0xff), pending_state = _mm256_set1_epi32(UCTEdge::CNN_PENDING);
+                const __m256i step = _mm256_set1_epi32(8);
+                __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+                __m256 vbest = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+                __m256i vbest_idx = _mm256_setzero_si256();
+                for (; i + 8 <= n; i += 8)
+                {
+                    const UCTEdge *e = edges + i;
+                    // lane k holds edges i + k and i + k + 4; transpose each 128-bit half as a 4x4 matrix
+                    __m256 r0 = _mm256_insertf128_ps(_mm256_castps128_ps256(load_edge(e[0])), load_edge(e[4]), 1);
+                    __m256 r1 = _mm256_insertf128_ps(_mm256_castps128_ps256(load_edge(e[1])), load_edge(e[5]), 1);
+                    __m256 r2 = _mm256_insertf128_ps(_mm256_castps128_ps256(load_edge(e[2])), load_edge(e[6]), 1);
+                    __m256 r3 = _mm256_insertf128_ps(_mm256_castps128_ps256(load_edge(e[3])), load_edge(e[7]), 1);
+                    __m256 t0 = _mm256_unpacklo_ps(r0, r1), t1 = _mm256_unpackhi_ps(r0, r1);
+                    __m256 t2 = _mm256_unpacklo_ps(r2, r3), t3 = _mm256_unpackhi_ps(r2, r3);
+                    __m256i visit_bits = _mm256_castps_si256(_mm256_shuffle_ps(t0, t2, 0x44));
+                    __m256 mean = _mm256_shuffle_ps(t0, t2, 0xee);
+                    __m256i flags = _mm256_castps_si256(_mm256_shuffle_ps(t1, t3, 0x44));
+                    __m256 prior = _mm256_shuffle_ps(t1, t3, 0xee);
+
+                    __m256 visit_cnt = _mm256_cvtepi32_ps(visit_bits);
+                    __m256 q = _mm256_mul_ps(mean, visit_cnt);
+                    __m256 pending = _mm256_max_ps(zero, _mm256_cvtepi32_ps(
+                            _mm256_srai_epi32(_mm256_slli_epi32(flags, 16), 16)));
+                    __m256 loss = _mm256_mul_ps(_mm256_mul_ps(pending, vl),
+                                                _mm256_max_ps(one, _mm256_mul_ps(vl_ratio, visit_cnt)));
+                    visit_cnt = _mm256_add_ps(visit_cnt, loss);
+                    q = _mm256_sub_ps(q, loss);
+                    __m256 val = ScoreT::value(q, visit_cnt, prior, exploration);
+
+                    __m256i done = _mm256_cmpgt_epi32(_mm256_srli_epi32(flags, 24), _mm256_setzero_si256());
+                    __m256i in_flight = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_srli_epi32(flags, 16), byte_mask),
+                                                           pending_state);
+                    val = _mm256_blendv_ps(undone_val, val, _mm256_castsi256_ps(done));
+                    val = _mm256_blendv_ps(val, pending_val, _mm256_castsi256_ps(in_flight));
+
+                    __m256 better = _mm256_cmp_ps(val, vbest, _CMP_GT_OQ);
+                    vbest = _mm256_blendv_ps(vbest, val, better);
+                    vbest_idx = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(vbest_idx),
+                                                                     _mm256_castsi256_ps(idx), better));
+                    idx = _mm256_add_epi32(idx, step);
+                }
+                alignas(32) float lane_val[8];
+                alignas(32) std::int32_t lane_idx[8];
+                _mm256_store_ps(lane_val, vbest);
+                _mm256_store_si256(reinterpret_cast<__m256i *>(lane_idx), vbest_idx);
+                for (int k=0; k<8; ++k)
+                    if (lane_val[k] > best_val || (lane_val[k] == best_val && (std::size_t) lane_idx[k] < best))
+                    {
+                        best_val = lane_val[k];
+                        best = lane_idx[k];
+                    }
+            }
+#elif defined(__SSE2__)
+            if (n >= 4)
+            {
+                const __m128 one = _mm_set1_ps(1.0f);
+                const __m128 zero = _mm_setzero_ps(), exploration = _mm_set1_ps(p.exploration);
+                const __m128 vl = _mm_set1_ps(p.virtual_loss), vl_ratio = _mm_set1_ps(p.virtual_loss_ratio);
+                const __m128 undone_val = _mm_set1_ps(-1.0f);
+                const __m128 pending_val = _mm_set1_ps(std::numeric_limits<float>::lowest());
+                const __m128i byte_mask = _mm_set1_epi32(0xff), pending_state = _mm_set1_epi32(UCTEdge::CNN_PENDING);
+                const __m128i step = _mm_set1_epi32(4);
+                __m128i idx = _mm_setr_epi32(0, 1, 2, 3);
+                __m128 vbest = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+                __m128i vbest_idx = _mm_setzero_si128();
+                for (; i + 4 <= n; i += 4)
+                {
+                    const UCTEdge *e = edges + i;
+                    __m128 r0 = load_edge(e[0]), r1 = load_edge(e[1]), r2 = load_edge(e[2]), r3 = load_edge(e[3]);
+                    _MM_TRANSPOSE4_PS(r0, r1, r2, r3); // r0: visits, r1: mean, r2: flags, r3: prior
+                    __m128i flags = _mm_castps_si128(r2);
+
+                    __m128 visit_cnt = _mm_cvtepi32_ps(_mm_castps_si128(r0));
+                    __m128 q = _mm_mul_ps(r1, visit_cnt);
+                    __m128 pending = _mm_max_ps(zero, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(flags, 16), 16)));
+                    __m128 loss = _mm_mul_ps(_mm_mul_ps(pending, vl), _mm_max_ps(one, _mm_mul_ps(vl_ratio, visit_cnt)));
+                    visit_cnt = _mm_add_ps(visit_cnt, loss);
+                    q = _mm_sub_ps(q, loss);
+                    __m128 val = ScoreT::value(q, visit_cnt, r3, exploration);
+
+                    __m128 done = _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_srli_epi32(flags, 24), _mm_setzero_si128()));
+                    __m128 in_flight = _mm_castsi128_ps(_mm_cmpeq_epi32(
+                            _mm_and_si128(_mm_srli_epi32(flags, 16), byte_mask), pending_state));
+                    val = _mm_or_ps(_mm_and_ps(done, val), _mm_andnot_ps(done, undone_val));
+                    val = _mm_or_ps(_mm_and_ps(in_flight, pending_val), _mm_andnot_ps(in_flight, val));
+
+                    __m128i better = _mm_castps_si128(_mm_cmpgt_ps(val, vbest));
+                    vbest = _mm_max_ps(vbest, val);
+                    vbest_idx = _mm_or_si128(_mm_and_si128(better, idx), _mm_andnot_si128(better, vbest_idx));
+                    idx = _mm_add_epi32(idx, step);
+                }
+                alignas(16) float lane_val[4];
+                alignas(16) std::int32_t lane_idx[4];
+                _mm_store_ps(lane_val, vbest);
+                _mm_store_si128(reinterpret_cast<__m128i *>(lane_idx), vbest_idx);
+                for (int k=0; k<4; ++k)
+                    if (lane_val[k] > best_val || (lane_val[k] == best_val && (std::size_t) lane_idx[k] < best))
+                    {
+                        best_val = lane_val[k];
+                        best = lane_idx[k];
+                    }
+            }
+#endif
+            for (; i < n; ++i)
+            {
+                float val = edge_value<ScoreT>(edges[i], p);
+                if (val > best_val)
+                {
+                    best_val = val;
+                    best = i;
+                }
+            }
+            return best;
+        }
+
+        inline std::size_t select_ucb(const UCTEdge *edges, std::size_t n, const SelectParams &p)
+        {
+            float best_val;
+            return select_best<UCB1Score>(edges, n, p, best_val);
+        }
+    }
+}
+
+#endif //LIBUCT_UCB_SELECT_HPP
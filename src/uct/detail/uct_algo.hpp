@@ -9,7 +9,15 @@
 #include <board.hpp>
 #include "logger.hpp"
 #include "cnn_v1.hpp"
+#include "cnn_batch.hpp"
+#include "evaluator.hpp"
+#include "conv_evaluator.hpp"
+#include "zobrist.hpp"
+#include "transposition.hpp"
+#include "cnn_cache.hpp"
+#include "ucb_select.hpp"
 #include <cstddef>
+#include <cmath>
 #include <memory>
 #include <mutex>
 #include <random>
@@ -17,6 +25,12 @@
 #include <numeric>
 #include <algorithm>
 #include <sstream>
+#include <limits>
+#include <thread>
+#include <unordered_map>
+#include <cstdint>
+#include <chrono>
+#include <stdexcept>
 #include <fastrollout/fastrollout.hpp>
 
 namespace uct
@@ -29,69 +43,192 @@ namespace uct
             return W * H / 8;
         }
 
+        // Board at some node, kept so that tree_policy can resume from it instead of replaying from the root
+        template<std::size_t W, std::size_t H>
+        struct BoardSnapshot
+        {
+            board::Board<W, H> board;
+            std::atomic<long> *live_cnt; // owner's count of snapshots alive
+
+            BoardSnapshot(const board::Board<W, H> &b, std::atomic<long> *live_cnt):
+                    board(b), live_cnt(live_cnt)
+            {
+                live_cnt->fetch_add(1);
+            }
+
+            BoardSnapshot(const BoardSnapshot &) = delete;
+            BoardSnapshot& operator=(const BoardSnapshot &) = delete;
+
+            ~BoardSnapshot()
+            {
+                live_cnt->fetch_sub(1);
+            }
+        };
+
+        // Cold data of a node: only touched when the node is entered, expanded or backed up through
         template<std::size_t W, std::size_t H>
         struct UCTTreeNodeBlock
         {
-            std::atomic<int> visit_cnt {0};
             std::atomic<int> try_before_cnn {0};
 
-            static const std::size_t Q_BASE = 4096; // if it's too small, we may lose precision; too large: overflow;
-            // 2^32 / 4096 = 2^20, large enough for single traversal
-        private:
-            std::atomic_int_fast32_t q { 0 }; // Q in UCT, multiplied by Q_BASE
-            static const std::int16_t MAGIC_NUM = 0x38e5;
-            volatile const std::int16_t magic_num = MAGIC_NUM; // if magic_num is not ok, then we may read dirty data
-        public:
             board::GridPoint<W, H> action; // the action from parent to this node
-            std::mutex expand_mutex;
-            std::atomic_bool default_policy_done {false};
             board::Player player; // Next step is which player's round
 
-            using GoodPositionType =
-            decltype(std::declval<board::Board<W, H>>().getAllGoodPosition(std::declval<board::Player>()));
+            // Board after this node's action, set at most once (see UCTConfig::board_snapshot_interval). @nullable
+            std::atomic<BoardSnapshot<W, H> *> snapshot {nullptr};
 
-            std::unique_ptr<std::vector<board::GridPoint<W, H>>> pGoodPos;
-            // Good positions to place, no duplicates
+            // A move to expand, with its CNN probability
+            struct Candidate
+            {
+                board::GridPoint<W, H> action;
+                float prior;
+            };
+            using CandidateList = std::vector<Candidate>;
+
+            // Transposition table slot of this position, set before cnn_state becomes READY. @nullable
+            using TTType = TranspositionTable<std::shared_ptr<const CandidateList>>;
+            std::uint64_t tt_key = 0;
+            typename TTType::EntryType *tt_entry = nullptr;
+
+            std::unique_ptr<CandidateList> pGoodPos;
+            // Good positions to place, no duplicates, best last; child i is expanded with the i-th from the back.
+            // Published by the edge's cnn_state and never modified after that, except that a fallback list is
+            // dropped with the node's children when its search ends (UCTTreePolicy::dropFallbacks).
             // @nullable
 
             UCTTreeNodeBlock(const UCTTreeNodeBlock& other):
-                    visit_cnt(other.visit_cnt.load()), default_policy_done(other.default_policy_done.load()),
-                    q(other.q.load()),
                     action(other.action),
-                    player(other.player)
+                    player(other.player),
+                    tt_key(other.tt_key), tt_entry(other.tt_entry)
 
             {
                 if (other.pGoodPos)
-                    pGoodPos.reset(new GoodPositionType (*other.pGoodPos));
+                    pGoodPos.reset(new CandidateList (*other.pGoodPos));
+                if (BoardSnapshot<W, H> *snap = other.snapshot.load())
+                    snapshot.store(new BoardSnapshot<W, H>(snap->board, snap->live_cnt));
+            }
+
+            // Used when Tree::advance promotes a child to root: keeps its CNN state and takes over its candidate
+            // list and board snapshot instead of copying them
+            UCTTreeNodeBlock(UCTTreeNodeBlock&& other):
+                    try_before_cnn(other.try_before_cnn.load()),
+                    action(other.action),
+                    player(other.player),
+                    snapshot(other.snapshot.exchange(nullptr)),
+                    tt_key(other.tt_key), tt_entry(other.tt_entry),
+                    pGoodPos(std::move(other.pGoodPos))
+            {}
+
+            ~UCTTreeNodeBlock()
+            {
+                delete snapshot.load();
             }
 
             explicit UCTTreeNodeBlock(board::Player player, board::GridPoint<W, H> action):
-                    player(player), action(action)
+                    action(action), player(player)
             {}
 
             UCTTreeNodeBlock& operator= (const UCTTreeNodeBlock &other)
             {
-                visit_cnt = other.visit_cnt.load();
-                default_policy_done.store(other.default_policy_done.load());
-                q = other.q.load();
                 action = other.action;
                 player = other.player;
+                return *this;
+            }
+        };
+
+        enum class VirtualLossMode
+        {
+            NONE,
+            CONSTANT,    // each in-flight thread counts as virtual_loss lost playouts
+            VISIT_SCALED // ... as virtual_loss * max(1, virtual_loss_ratio * visit_cnt), so it still bites on big nodes
+        };
+
+        struct UCTConfig
+        {
+            VirtualLossMode virtual_loss_mode = VirtualLossMode::CONSTANT;
+            double virtual_loss = 1.0;
+            double virtual_loss_ratio = 0.01;
+
+            // Evaluates positions instead of the CNN server at addr:port when set (e.g. a ConvPolicyEvaluator);
+            // the cnn_* connection settings below only apply to the server
+            std::shared_ptr<PolicyEvaluator> evaluator;
+
+            ConnectionMode cnn_conn_mode = ConnectionMode::ONE_SHOT;
+            WireFormat cnn_wire_format = WireFormat::BYTE_PLANES; // BIT_PLANES needs a server that understands it
+            FrameConfig cnn_frame;
+            // Deadline of one CNN call; 0 only bounds it by the end of the running search. A call that misses its
+            // deadline falls back to the legal moves in getAllGoodPosition order, for the rest of the search only.
+            // Stopping the search aborts calls in flight either way, also with cnn_batching.
+            std::chrono::milliseconds cnn_timeout {0};
+            bool cnn_batching = false; // coalesce CNN requests from all search threads (server must accept batches)
+            CNNBatchConfig cnn_batch;
+
+            // Nodes whose depth is a multiple of this keep a copy of their board, so that a descent only replays
+            // the moves below the deepest such ancestor. 0 replays every path from the root.
+            std::size_t board_snapshot_interval = 8;
+            std::size_t max_board_snapshots = 1 << 14;
+
+            // Master seed for the per-thread rollout engines; 0 draws one from std::random_device.
+            // With a fixed seed, search thread i always gets the same stream, whichever pool worker runs it.
+            std::uint32_t seed = 0;
+
+            // Share CNN good positions between transpositions (same stones, ko and player to move)
+            bool use_transposition_table = false;
+            std::size_t transposition_table_size = 1 << 16; // slots
+            bool transposition_share_stats = false; // also pool visit/Q statistics of transposed nodes in uctVal
+
+            // PUCTSelection: weight of the prior-driven exploration term, and how much worse than its parent's mean
+            // value a move counts before its first playout (first-play urgency)
+            double c_puct = 1.5;
+            double puct_fpu_reduction = 0.25;
+
+            // Progressive widening: a node with n visits has max(1, widening_k * n^widening_alpha) of its candidates
+            // (best first) materialized; its child range grows in chunks as they are admitted.
+            // 0 disables it: up to CH_BUF_SIZE children at once.
+            double widening_k = 0.0;
+            double widening_alpha = 0.5;
+
+            // Remember CNN probabilities of this many positions, across searches; 0 disables the cache
+            std::size_t cnn_cache_size = 0;
+            bool cnn_cache_symmetries = true; // positions equal up to rotation/reflection share one entry
+        };
+
+        // Selection rules, the SelectionT parameter of UCTTreePolicy. ScoreType scores a child (see select_best) from
+        // the per-node exploration term; candidateValue is what expanding the next candidate move is worth.
+        //
+        // UCB1 has no use for the priors and expands every candidate before it compares children.
+        struct UCB1Selection
+        {
+            using ScoreType = UCB1Score;
+
+            static float exploration(double parent_visit_cnt, const UCTConfig &)
+            {
+                return 2.0f * std::log((float) parent_visit_cnt);
             }
 
-            double getQ() const
+            static float candidateValue(const UCTEdge &, float, float, const UCTConfig &)
             {
-                return (double) q.load() / Q_BASE;
+                return std::numeric_limits<float>::infinity();
             }
+        };
+
+        // PUCT: the priors share out the exploration bonus, so likely moves are expanded and revisited first
+        struct PUCTSelection
+        {
+            using ScoreType = PUCTScore;
 
-            void addQ(double newQ)
+            static float exploration(double parent_visit_cnt, const UCTConfig &config)
             {
-                int to_add = static_cast<int>(newQ * Q_BASE);
-                q.fetch_add(to_add);
+                return (float) (config.c_puct * std::sqrt(std::max(1.0, parent_visit_cnt)));
             }
 
-            bool isClean() const volatile
+            // The parent's mean value for the player to move there (it is stored for the other one), less the
+            // first-play urgency reduction, plus the exploration bonus of a move without visits
+            static float candidateValue(const UCTEdge &parent_edge, float prior, float exploration,
+                                        const UCTConfig &config)
             {
-                return magic_num == MAGIC_NUM;
+                double parent_value = -parent_edge.stats.load().mean; // 0 without visits
+                return (float) (parent_value - config.puct_fpu_reduction) + exploration * prior;
             }
         };
 
@@ -99,56 +236,395 @@ namespace uct
         struct UCTTreePolicyResult
         {
             board::Board<W, H> board;
+            bool virtual_loss_applied; // every node from the leaf up to the root holds one virtual loss
         };
 
 
-        template<std::size_t W, std::size_t H>
-        struct UCTTreePolicy: public TreePolicy<UCTTreeNodeBlock<W, H>, ChBufSize(W, H), UCTTreePolicyResult<W, H>>
+        template<std::size_t W, std::size_t H, typename SelectionT = UCB1Selection>
+        struct UCTTreePolicy: public StaticTreePolicy<UCTTreeNodeBlock<W, H>, ChBufSize(W, H),
+                UCTTreePolicyResult<W, H>, UCTEdge>
         {
-            using BaseT = TreePolicy<UCTTreeNodeBlock<W, H>, ChBufSize(W, H), UCTTreePolicyResult<W, H>>;
+            using BaseT = StaticTreePolicy<UCTTreeNodeBlock<W, H>, ChBufSize(W, H), UCTTreePolicyResult<W, H>, UCTEdge>;
             using TreeNodeType = typename BaseT::TreeNodeType;
             using TreeState = typename BaseT::TreeState;
             using TreePolicyResult = typename BaseT::TreePolicyResult;
             using PointType = typename board::Board<W, H>::PointType;
+            using CandidateList = typename UCTTreeNodeBlock<W, H>::CandidateList;
+            using SelectionType = SelectionT;
             static const std::size_t CH_BUF_SIZE = BaseT::CH_BUF_SIZE;
             std::atomic<int> global_visit_cnt {0};
+            std::atomic<std::size_t> cnn_pending_hit_cnt {0}; // iterations given up on a node awaiting its CNN result
+            std::atomic<std::size_t> cnn_fallback_cnt {0}; // nodes expanded without CNN ordering after a timeout
+            std::mutex fallback_mutex;
+            std::vector<TreeNodeType *> fallback_nodes; // of the running search, guarded by fallback_mutex
+            // End of the running search as Clock::time_point ticks; max outside Tree::run
+            std::atomic<PolicyEvaluator::Clock::rep> search_deadline {
+                    PolicyEvaluator::Clock::time_point::max().time_since_epoch().count()};
+            std::atomic<long> board_snapshot_cnt {0};
             std::shared_ptr<spdlog::logger> logger = getGlobalLogger();
 
-            const board::Board<W, H> init_board;
-            const board::Player init_player;
+            board::Board<W, H> init_board; // position at the root; moved forward by advanceRoot
+            board::Player init_player;
             const double komi;
+            const UCTConfig config;
+
+            // State private to one search thread, so rollouts never contend
+            struct ThreadContext
+            {
+                fastrollout::RandomRolloutPolicy<W, H> rolloutEngine;
+
+                explicit ThreadContext(std::uint32_t seed):
+                        rolloutEngine((int) seed)
+                {}
+            };
+
+        private:
+            const std::uint64_t policy_id = next_policy_id();
+            const std::uint32_t master_seed = config.seed ? config.seed : std::random_device()();
+            std::mutex contexts_mutex;
+            // guarded by contexts_mutex
+            std::unordered_map<std::size_t, std::unique_ptr<ThreadContext>> search_contexts; // by searchThreadIndex()
+            std::unordered_map<std::thread::id, std::unique_ptr<ThreadContext>> other_contexts; // outside a search
+
+            static std::uint64_t next_policy_id()
+            {
+                static std::atomic<std::uint64_t> id {1};
+                return id.fetch_add(1);
+            }
 
-            std::mt19937 gen { std::random_device()() };
+        public:
+            // The calling thread's context, created on first use. Search thread i gets a seed derived from the
+            // master seed and i; other threads (e.g. the one calling Tree::advance) one derived from the master
+            // seed and the number of such threads before it.
+            ThreadContext &threadContext()
+            {
+                struct Cache
+                {
+                    std::uint64_t policy_id;
+                    std::size_t search_idx;
+                    ThreadContext *ctx;
+                };
+                static thread_local Cache cache = {0, NO_SEARCH_THREAD, nullptr};
+                const std::size_t search_idx = searchThreadIndex();
+                if (cache.policy_id == policy_id && cache.search_idx == search_idx)
+                    return *cache.ctx;
+
+                std::lock_guard<std::mutex> lock(contexts_mutex);
+                const bool in_search = search_idx != NO_SEARCH_THREAD;
+                std::unique_ptr<ThreadContext> &ctx = in_search ? search_contexts[search_idx] :
+                                                      other_contexts[std::this_thread::get_id()];
+                if (!ctx)
+                {
+                    std::seed_seq seq {master_seed, (std::uint32_t) in_search,
+                                       (std::uint32_t) (in_search ? search_idx : other_contexts.size())};
+                    std::uint32_t thread_seed;
+                    seq.generate(&thread_seed, &thread_seed + 1);
+                    ctx.reset(new ThreadContext(thread_seed));
+                }
+                cache.policy_id = policy_id;
+                cache.search_idx = search_idx;
+                cache.ctx = ctx.get();
+                return *ctx;
+            }
 
             UCTTreePolicy(const board::Board<W, H> &b, board::Player player, double komi, const std::string addr,
-            unsigned short port):
-                    init_board(b), init_player(player), komi(komi), reqv2ServiceCompact(addr, port)
+            unsigned short port, const UCTConfig &config = UCTConfig()):
+                    init_board(b), init_player(player), komi(komi), config(config),
+                    evaluator(config.evaluator ? config.evaluator : std::make_shared<RemotePolicyEvaluator>(
+                            addr, port, config.cnn_conn_mode, config.cnn_wire_format, config.cnn_frame,
+                            config.cnn_batching, config.cnn_batch)),
+                    transpositionTable(config.use_transposition_table ?
+                                       new TTType(config.transposition_table_size) : nullptr),
+                    cnnCache(config.cnn_cache_size ?
+                             new CNNResponseCache<W, H>(config.cnn_cache_size, config.cnn_cache_symmetries) : nullptr)
             {}
 
-            static double uctVal(const TreeNodeType& node)
+            // Without a CNN server: config.evaluator must be set
+            UCTTreePolicy(const board::Board<W, H> &b, board::Player player, double komi, const UCTConfig &config):
+                    UCTTreePolicy(b, player, komi, "127.0.0.1", 0, config)
             {
-                return node.block.default_policy_done ?
-                       node.block.getQ() / node.block.visit_cnt.load() +
-                       0.5 * std::sqrt(
-                               node.parent ?
-                               2 * std::log(node.parent->block.visit_cnt.load()) / node.block.visit_cnt.load() :
-                               2.0
-                       ) :
-                       -1.0;
+                if (!config.evaluator)
+                    throw std::invalid_argument("UCTConfig::evaluator must be set when no CNN server is given");
             }
 
-            detail::RequestV2ServiceCompact reqv2ServiceCompact;
-            auto getCNNGoodPositions(board::Board<W, H> &b, board::Player player) ->
-            typename UCTTreeNodeBlock<W, H>::GoodPositionType
+            double virtualLossWeight(int visit_cnt) const
+            {
+                switch (config.virtual_loss_mode)
+                {
+                    case VirtualLossMode::CONSTANT:
+                        return config.virtual_loss;
+                    case VirtualLossMode::VISIT_SCALED:
+                        return config.virtual_loss * std::max(1.0, config.virtual_loss_ratio * visit_cnt);
+                    default:
+                        return 0.0;
+                }
+            }
+
+            // Score of the move with the given edge; block (the child's) is only read when sharing TT statistics
+            double uctVal(const UCTEdge &edge, const UCTEdge *parent_edge, const UCTTreeNodeBlock<W, H> &block) const
+            {
+                if (!edge.default_policy_done)
+                    return -1.0;
+                PackedStats::Snapshot stats = edge.stats.load();
+                double visit_cnt = stats.visit_cnt;
+                double q = stats.getQ();
+                if (config.transposition_share_stats &&
+                    edge.cnn_state.load(std::memory_order_acquire) == UCTEdge::CNN_READY &&
+                    TTType::holds(block.tt_entry, block.tt_key))
+                {
+                    // transpositions have seen this position more often: use their pooled mean value
+                    PackedStats::Snapshot shared = block.tt_entry->stats.load();
+                    if (shared.visit_cnt > visit_cnt)
+                    {
+                        q = (double) shared.mean * visit_cnt;
+                    }
+                }
+                int pending = edge.virtual_loss_cnt.load();
+                if (pending > 0)
+                {
+                    // pretend the in-flight playouts have all been lost
+                    double loss = pending * virtualLossWeight((int) visit_cnt);
+                    visit_cnt += loss;
+                    q -= loss;
+                }
+                return SelectionT::ScoreType::value((float) q, (float) visit_cnt, edge.prior, parent_edge ?
+                        SelectionT::exploration(parent_edge->stats.getVisitCnt(), config) : 0.0f);
+            }
+
+            double uctVal(const TreeNodeType& node) const
+            {
+                return uctVal(*node.edge, node.parent ? node.parent->edge : nullptr, node.block);
+            }
+
+            SelectParams selectParams(const UCTEdge &parent_edge) const
+            {
+                SelectParams p;
+                p.exploration = SelectionT::exploration(parent_edge.stats.getVisitCnt(), config);
+                p.virtual_loss = config.virtual_loss_mode == VirtualLossMode::NONE ? 0.0f : (float) config.virtual_loss;
+                p.virtual_loss_ratio = config.virtual_loss_mode == VirtualLossMode::VISIT_SCALED ?
+                                       (float) config.virtual_loss_ratio : 0.0f;
+                return p;
+            }
+
+            // Children a node with candidate_cnt candidates can get. With widening its child range grows in chunks
+            // as admittedChildren rises, so the bound costs no memory until children are admitted.
+            std::size_t childCapacity(std::size_t candidate_cnt) const
+            {
+                if (config.widening_k > 0)
+                    return candidate_cnt;
+                return candidate_cnt < CH_BUF_SIZE ? candidate_cnt : CH_BUF_SIZE;
+            }
+
+            // Children materialized so far, best candidates first, out of capacity after visit_cnt visits
+            std::size_t admittedChildren(std::uint32_t visit_cnt, std::size_t capacity) const
+            {
+                if (config.widening_k <= 0)
+                    return capacity;
+                double widened = config.widening_k * std::pow(std::max(1.0, (double) visit_cnt), config.widening_alpha);
+                return std::min(capacity, std::max<std::size_t>(1, (std::size_t) widened));
+            }
+
+            // Whether node may still get children: its candidates aren't known yet, or some aren't materialized
+            bool mayExpand(const TreeNodeType *node) const
+            {
+                if (node->edge->cnn_state.load(std::memory_order_acquire) != UCTEdge::CNN_READY)
+                    return true;
+                return node->ch.size() < childCapacity(node->block.pGoodPos->size());
+            }
+
+            // Best of node's first child_cnt children, scored into best_val. The edges are scanned one chunk of the
+            // child range at a time; without widening that is a single chunk.
+            std::size_t selectChild(TreeNodeType *node, std::size_t child_cnt, const SelectParams &params,
+                                    float &best_val) const
+            {
+                std::size_t best = 0;
+                best_val = -std::numeric_limits<float>::infinity();
+                // Pooled transposition statistics live in the child blocks, out of select_best's reach
+                if (!config.transposition_share_stats)
+                {
+                    node->ch.edge_ranges(child_cnt, [&](const UCTEdge *edges, std::size_t first, std::size_t cnt) {
+                        float val;
+                        std::size_t i = select_best<typename SelectionT::ScoreType>(edges, cnt, params, val);
+                        if (val > best_val)
+                        {
+                            best_val = val;
+                            best = first + i;
+                        }
+                    });
+                    return best;
+                }
+
+                node->ch.edge_ranges(child_cnt, [&](const UCTEdge *edges, std::size_t first, std::size_t cnt) {
+                    const TreeNodeType *children = &node->ch[first]; // contiguous within a chunk
+                    for (std::size_t i=0; i<cnt; ++i)
+                    {
+                        // Divert from children whose CNN evaluation is in flight; we'd only bail out there
+                        float val = edges[i].cnn_state.load() == UCTEdge::CNN_PENDING ?
+                                    std::numeric_limits<float>::lowest() :
+                                    (float) uctVal(edges[i], node->edge, children[i].block);
+                        if (val > best_val)
+                        {
+                            best_val = val;
+                            best = first + i;
+                        }
+                    }
+                });
+                return best;
+            }
+
+            void applyVirtualLoss(TreeNodeType *node)
+            {
+                if (config.virtual_loss_mode != VirtualLossMode::NONE)
+                    node->edge->virtual_loss_cnt.fetch_add(1);
+            }
+
+            // Revert the virtual losses from node up to the root
+            void revertVirtualLoss(TreeNodeType *node)
+            {
+                if (config.virtual_loss_mode != VirtualLossMode::NONE)
+                    for (; node; node = node->parent)
+                        node->edge->virtual_loss_cnt.fetch_sub(1);
+            }
+
+            std::shared_ptr<PolicyEvaluator> evaluator;
+            using TTType = typename UCTTreeNodeBlock<W, H>::TTType;
+            std::unique_ptr<TTType> transpositionTable; // @nullable
+            std::unique_ptr<CNNResponseCache<W, H>> cnnCache; // @nullable
+
+            void onSearchBegin(std::chrono::steady_clock::time_point deadline)
+            {
+                search_deadline.store(deadline.time_since_epoch().count());
+            }
+
+            // Calls in flight give up and fall back; fallback lists are dropped again by onSearchEnd
+            void onStopRequested()
+            {
+                search_deadline.store(PolicyEvaluator::Clock::now().time_since_epoch().count());
+                evaluator->cancelAll();
+            }
+
+            void onSearchEnd()
+            {
+                using Clock = PolicyEvaluator::Clock;
+                search_deadline.store(Clock::time_point::max().time_since_epoch().count());
+                dropFallbacks();
+                CNNLatencyStats stats = evaluator->getLatencyStats();
+                logger->debug("CNN latency: {} calls, {} timeouts, p50 {}ms, p90 {}ms, p99 {}ms, max {}ms; "
+                              "{} fallback expansions", stats.call_cnt, stats.timeout_cnt, stats.p50_ms,
+                              stats.p90_ms, stats.p99_ms, stats.max_ms, cnn_fallback_cnt.load());
+            }
+
+            // Deadline for a CNN call starting now
+            PolicyEvaluator::Clock::time_point cnnDeadline() const
+            {
+                using Clock = PolicyEvaluator::Clock;
+                Clock::time_point deadline {Clock::duration(search_deadline.load())};
+                if (config.cnn_timeout.count() > 0)
+                    deadline = std::min(deadline, Clock::now() + config.cnn_timeout);
+                return deadline;
+            }
+
+            // Legal good positions without CNN ordering, for when the CNN doesn't answer in time
+            CandidateList fallbackGoodPositions(board::Board<W, H> &b, board::Player player)
+            {
+                auto goodPosVec = b.getAllGoodPosition(player);
+                CandidateList ans;
+                ans.reserve(goodPosVec.size());
+                for (const auto &p: goodPosVec)
+                    if (b.getPosStatus(p, player) == board::Board<W, H>::PositionStatus::OK)
+                        ans.push_back({p, 0.0f});
+                for (auto &c: ans)
+                    c.prior = 1.0f / ans.size(); // nothing to tell them apart
+                return ans;
+            }
+
+            // Good positions of the node's board, from the transposition table when enabled and filled. Sets
+            // fallback if the CNN didn't answer in time and the list comes from fallbackGoodPositions.
+            CandidateList evaluateGoodPositions(board::Board<W, H> &b, board::Player player,
+                                                UCTTreeNodeBlock<W, H> &block, bool &fallback)
+            {
+                fallback = false;
+                try
+                {
+                    return evaluateCNNGoodPositions(b, player, block);
+                } catch (const CNNTimeoutError &e)
+                {
+                    logger->debug("{}, expanding without CNN ordering", e.what());
+                    cnn_fallback_cnt.fetch_add(1);
+                    fallback = true;
+                    return fallbackGoodPositions(b, player);
+                }
+            }
+
+            // Remember a node about to publish a fallback list. Called before its cnn_state becomes READY, so the
+            // node is recorded after every fallback node above it.
+            void rememberFallback(TreeNodeType *node)
+            {
+                std::lock_guard<std::mutex> lock(fallback_mutex);
+                fallback_nodes.push_back(node);
+            }
+
+            // Fallback lists only stand in for the CNN during the search that made them. Once its threads have
+            // joined, forget them with the children expanded from them, so a later visit asks the CNN again.
+            // Newest first: a node's fallback descendants were recorded after it and go away with its children.
+            void dropFallbacks()
+            {
+                std::lock_guard<std::mutex> lock(fallback_mutex);
+                for (auto it = fallback_nodes.rbegin(); it != fallback_nodes.rend(); ++it)
+                {
+                    TreeNodeType *node = *it;
+                    node->release_children(*this->node_arena);
+                    node->block.pGoodPos.reset();
+                    node->block.try_before_cnn.store(TRY_BEFORE_CNN_THRESHOLD); // ask on the next visit
+                    node->edge->cnn_state.store(UCTEdge::CNN_NONE);
+                }
+                if (!fallback_nodes.empty())
+                    logger->debug("Dropped {} CNN fallback lists and their children", fallback_nodes.size());
+                fallback_nodes.clear();
+            }
+
+            CandidateList evaluateCNNGoodPositions(board::Board<W, H> &b, board::Player player,
+                                                   UCTTreeNodeBlock<W, H> &block)
             {
                 auto requestV2 = b.generateRequestV2(player);
-                auto resp = reqv2ServiceCompact.sync_call(requestV2);
-                auto &possibility = *resp.mutable_possibility();
+                if (!transpositionTable)
+                    return getCNNGoodPositions(b, player, requestV2);
+
+                std::uint64_t key = Zobrist<W, H>::instance().hashRequest(requestV2, player);
+                std::shared_ptr<const CandidateList> shared;
+                block.tt_key = key;
+                if ((block.tt_entry = transpositionTable->lookup(key, shared)))
+                    return *shared;
+                std::shared_ptr<const CandidateList> result(
+                        new CandidateList(getCNNGoodPositions(b, player, requestV2)));
+                block.tt_entry = transpositionTable->store(key, result);
+                return *result;
+            }
+
+            CandidateList getCNNGoodPositions(board::Board<W, H> &b, board::Player player)
+            {
+                return getCNNGoodPositions(b, player, b.generateRequestV2(player));
+            }
+
+            // The most probable good moves, until their probabilities add up to a step-dependent threshold; priors
+            // are their probabilities, renormalized over the kept moves
+            CandidateList getCNNGoodPositions(board::Board<W, H> &b, board::Player player,
+                                              const gocnn::RequestV2 &requestV2)
+            {
+                static thread_local std::vector<float> possibility; // reused, so evaluating doesn't allocate
+                if (!cnnCache || !cnnCache->lookup(requestV2, player, possibility))
+                {
+                    // the token first: a stop between the two still aborts the call
+                    std::uint64_t cancel_token = evaluator->getCancelCount();
+                    evaluator->evaluate(requestV2, possibility, cnnDeadline(), cancel_token);
+                    if (cnnCache)
+                        cnnCache->store(requestV2, player, possibility.data(), possibility.size());
+                }
                 using PairT = std::pair<PointType, double>;
                 std::vector<PairT> vp;
                 vp.reserve(W * H);
                 for (std::size_t i=0; i<possibility.size(); ++i)
-                    vp.emplace_back(PointType(i / H, i % H), possibility.data()[i]);
+                    vp.emplace_back(PointType(i / H, i % H), possibility[i]);
                 std::sort(vp.begin(), vp.end(), [](const PairT &a, const PairT &b) {
                    return a.second > b.second;
                 }); // vp: possibility large -> small
@@ -167,144 +643,258 @@ namespace uct
                 }
                 vp.erase(it, vp.end());
 
-                std::vector<PointType> ans; ans.reserve(W * H);
+                CandidateList ans; ans.reserve(vp.size()); // kept for the node's lifetime: no slack
+                double kept = 0.0;
                 std::for_each(vp.rbegin(), vp.rend(), [&](const PairT &p) {
                     if (b.getPosStatus(p.first, player) == board::Board<W, H>::PositionStatus::OK &&
                             std::find(goodPosVec.cbegin(), goodPosVec.cend(), p.first) != goodPosVec.cend())
-                        ans.push_back(p.first);
+                    {
+                        ans.push_back({p.first, (float) p.second});
+                        kept += p.second;
+                    }
                 }); // ans: small to large
+                for (auto &c: ans)
+                    c.prior = kept > 0.0 ? (float) (c.prior / kept) : 1.0f / ans.size();
                 return ans;
             }
 
             static const int TRY_BEFORE_CNN_THRESHOLD = 32;
+            static const std::size_t NO_CHILD = static_cast<std::size_t>(-1);
 
-            virtual TreePolicyResult tree_policy(TreeNodeType *root) override
+            TreePolicyResult tree_policy(TreeNodeType *root)
             {
                 TreeNodeType *cur_node = root;
-                board::Board<W, H> cur_board(init_board);
                 board::Player cur_player = init_player;
+                const bool use_virtual_loss = config.virtual_loss_mode != VirtualLossMode::NONE;
+
+                // The board is only built when it is needed (CNN call or expansion): start from the deepest
+                // snapshotted node of the path and replay the moves below it
+                const board::Board<W, H> *base_board = &init_board;
+                std::size_t depth = 0;
+                static thread_local std::vector<std::pair<PointType, board::Player>> moves_since_base;
+                moves_since_base.clear();
+                auto build_board = [&]() -> board::Board<W, H> {
+                    board::Board<W, H> b(*base_board);
+                    for (const auto &m: moves_since_base)
+                        b.place(m.first, m.second);
+                    return b;
+                };
+
+                // Every node entered on the way down holds a virtual loss until default_policy backs it up
+                auto give_up = [&]() -> TreePolicyResult {
+                    revertVirtualLoss(cur_node);
+                    return std::make_pair(nullptr, TreeState {board::Board<W, H>(), false});
+                };
+                if (root)
+                    applyVirtualLoss(root);
 
                 for (;;)
                 {
                     global_visit_cnt.fetch_add(1);
                     // Node's visit_cnt will be updated in default_policy's propagation
                     if (!cur_node)
-                        return std::make_pair(nullptr, TreeState {cur_board});
+                        return give_up();
 
                     TreeNodeType *expand_node = nullptr;
-                    if (!cur_node->block.default_policy_done)
+                    if (!cur_node->edge->default_policy_done)
                     {
-                        return std::make_pair(nullptr, TreeState {cur_board});
+                        return give_up();
                     }
+                    const SelectParams params = selectParams(*cur_node->edge);
+                    std::size_t selected_ch_idx = NO_CHILD; // set once the children have been compared
+                    float best_val = -std::numeric_limits<float>::infinity();
 
-                    if (cur_node->ch.size() < CH_BUF_SIZE)
+                    if (mayExpand(cur_node))
                     {
-                        // double checking
-                        std::lock_guard<std::mutex> lock(cur_node->block.expand_mutex);
-                        if (cur_node->ch.size() < CH_BUF_SIZE &&
-                            (!cur_node->block.pGoodPos ||
-                             cur_node->ch.size() < cur_node->block.pGoodPos->size()
-                            )
-                                )
+                        auto &block = cur_node->block;
+                        UCTEdge &edge = *cur_node->edge;
+                        if (edge.cnn_state.load() != UCTEdge::CNN_READY)
                         {
-                            cur_node->block.try_before_cnn.fetch_add(1);
                             // Only calculate goodPos at the first time
-                            if (!cur_node->block.pGoodPos)
-                                if (cur_node->block.try_before_cnn.load() > TRY_BEFORE_CNN_THRESHOLD)
-                                    cur_node->block.pGoodPos.reset(new typename decltype(cur_node->block)::GoodPositionType
-                                    (getCNNGoodPositions(cur_board, cur_player)));
-                            else
-                                return std::make_pair(nullptr, TreeState {cur_board});
-                            logger->trace("Generate finished");
-                            auto &validPosVec = *cur_node->block.pGoodPos;
-                            if (validPosVec.empty())
-                                return std::make_pair(nullptr, TreeState {cur_board});
-
-                            std::size_t selected_index = validPosVec.size() - 1;
-                            PointType action = validPosVec[selected_index];
-                            validPosVec.pop_back(); // the last one: best
-
-                            cur_node->ch.emplace_back(cur_node, board::getOpponentPlayer(cur_player), action);
-                            expand_node = &*cur_node->ch.rbegin();
+                            if (block.try_before_cnn.fetch_add(1) + 1 <= TRY_BEFORE_CNN_THRESHOLD)
+                                return give_up();
+
+                            std::uint8_t expected = UCTEdge::CNN_NONE;
+                            if (edge.cnn_state.compare_exchange_strong(expected, UCTEdge::CNN_PENDING))
+                            {
+                                // We own the evaluation; other threads are diverted while the RPC is in flight
+                                std::unique_ptr<CandidateList> pGoodPos;
+                                bool fallback;
+                                try
+                                {
+                                    board::Board<W, H> cur_board = build_board();
+                                    maybeSnapshot(cur_node, depth, cur_board);
+                                    pGoodPos.reset(new CandidateList(
+                                            evaluateGoodPositions(cur_board, cur_player, block, fallback)));
+                                } catch (...)
+                                {
+                                    edge.cnn_state.store(UCTEdge::CNN_NONE);
+                                    throw;
+                                }
+                                logger->trace("Generate finished");
+                                if (fallback)
+                                    rememberFallback(cur_node);
+                                block.pGoodPos = std::move(pGoodPos);
+                                edge.cnn_state.store(UCTEdge::CNN_READY, std::memory_order_release);
+                            } else if (expected == UCTEdge::CNN_PENDING)
+                            {
+                                cnn_pending_hit_cnt.fetch_add(1);
+                                return give_up();
+                            }
+                        }
+
+                        // Expand the next candidate unless an existing child is worth more (by SelectionT)
+                        const CandidateList &candidates = *block.pGoodPos;
+                        const std::size_t capacity = childCapacity(candidates.size());
+                        const std::size_t admitted = admittedChildren(edge.stats.getVisitCnt(), capacity);
+                        std::size_t child_cnt = cur_node->ch.size();
+                        if (child_cnt < admitted)
+                        {
+                            float candidate_val = SelectionT::candidateValue(
+                                    edge, candidates[candidates.size() - 1 - child_cnt].prior, params.exploration, config);
+                            if (child_cnt && candidate_val != std::numeric_limits<float>::infinity())
+                                selected_ch_idx = selectChild(cur_node, child_cnt, params, best_val);
+                            // Claim the next child slot; racing threads get distinct slots, or none once all are taken
+                            std::size_t index;
+                            if (candidate_val > best_val &&
+                                cur_node->claim_child(*this->node_arena, capacity, admitted, index))
+                            {
+                                const auto &candidate = candidates[candidates.size() - 1 - index]; // best first
+                                cur_node->ch.edge(index).prior = candidate.prior;
+                                expand_node = &cur_node->emplace_claimed_child(
+                                        index, board::getOpponentPlayer(cur_player), candidate.action);
+                            }
                         }
                     }
 
                     if (expand_node)
                     {
+                        board::Board<W, H> cur_board = build_board();
                         cur_board.place(expand_node->block.action, cur_player);
-                        cur_player = board::getOpponentPlayer(cur_player);
-                        return std::make_pair(expand_node, TreeState {cur_board});
+                        applyVirtualLoss(expand_node);
+                        return std::make_pair(expand_node, TreeState {std::move(cur_board), use_virtual_loss});
                     }
                     else
                     {
                         TreeNodeType *selected_ch = nullptr;
 
-                        std::vector<double> uctValue;
-                        uctValue.reserve(CH_BUF_SIZE);
-
-                        for (std::size_t i=0; i<cur_node->ch.size(); ++i)
+                        if (selected_ch_idx == NO_CHILD)
                         {
-                            TreeNodeType & child = cur_node->ch[i];
-                            uctValue.push_back(uctVal(child));
+                            std::size_t child_cnt = cur_node->ch.size();
+                            if (!child_cnt)
+                                return give_up();
+                            // Selection only walks the packed sibling edges, not the child nodes
+                            selected_ch_idx = selectChild(cur_node, child_cnt, params, best_val);
                         }
-                        long selected_ch_idx = std::max_element(uctValue.begin(), uctValue.end()) - uctValue.begin();
-                        if (uctValue.empty())
-                            return std::make_pair(nullptr, TreeState {cur_board});
 
                         selected_ch = &(cur_node->ch[selected_ch_idx]);
 
                         cur_node = selected_ch;
-                        if (cur_node->block.isClean()) {
-                            cur_board.place(selected_ch->block.action, cur_player);
+                        applyVirtualLoss(cur_node);
+                        ++depth;
+                        if (BoardSnapshot<W, H> *snap = cur_node->block.snapshot.load(std::memory_order_acquire))
+                        {
+                            base_board = &snap->board;
+                            moves_since_base.clear();
                         } else
-                            return std::make_pair(nullptr, TreeState {cur_board});
+                            moves_since_base.emplace_back(cur_node->block.action, cur_player);
                         cur_player = board::getOpponentPlayer(cur_player);
                     }
                 }
             }
 
-            fastrollout::RandomRolloutPolicy<W, H> rolloutEngine{3};
-            virtual void default_policy(const TreePolicyResult &result) override
+            // Keep a copy of b (the board at node) if node sits on a snapshot depth and the budget allows
+            void maybeSnapshot(TreeNodeType *node, std::size_t depth, const board::Board<W, H> &b)
+            {
+                if (!config.board_snapshot_interval || !depth || depth % config.board_snapshot_interval ||
+                    node->block.snapshot.load() ||
+                    board_snapshot_cnt.load() >= (long) config.max_board_snapshots)
+                    return;
+                BoardSnapshot<W, H> *expected = nullptr;
+                BoardSnapshot<W, H> *snap = new BoardSnapshot<W, H>(b, &board_snapshot_cnt);
+                if (!node->block.snapshot.compare_exchange_strong(expected, snap, std::memory_order_release))
+                    delete snap;
+            }
+
+            void default_policy(const TreePolicyResult &result)
             {
                 TreeNodeType *cur_node = result.first;
                 const auto &board = result.second.board;
 
-                double cur_q = rolloutEngine.run(board, komi, cur_node->block.player);
+                double cur_q = threadContext().rolloutEngine.run(board, komi, cur_node->block.player);
                 // cur_q: higher <-> white dominates
 
                 while(cur_node)
                 {
                     // Next action is for Black <=> Previous action is for white <=> the higher the better
-                    cur_node->block.addQ(cur_node->block.player == board::Player::B ? cur_q : -cur_q);
-                    cur_node->block.visit_cnt.fetch_add(1);
+                    double node_q = cur_node->block.player == board::Player::B ? cur_q : -cur_q;
+                    cur_node->edge->stats.add(node_q); // visit and value in one atomic update
+                    if (config.transposition_share_stats &&
+                        cur_node->edge->cnn_state.load(std::memory_order_acquire) == UCTEdge::CNN_READY &&
+                        TTType::holds(cur_node->block.tt_entry, cur_node->block.tt_key))
+                        cur_node->block.tt_entry->addStats(node_q);
+                    if (result.second.virtual_loss_applied)
+                        cur_node->edge->virtual_loss_cnt.fetch_sub(1);
                     cur_node = cur_node->parent;
                 }
 
-                result.first->block.default_policy_done.store(true);
+                result.first->edge->default_policy_done.store(true);
             }
-            virtual std::size_t getFinalResultIndex(TreeNodeType *root) override
+
+            // Playouts through node, for Tree's early stop; getFinalResultIndex picks the most visited root child
+            std::uint32_t getVisitCount(const TreeNodeType &node) const
+            {
+                return node.edge->stats.getVisitCnt();
+            }
+
+            std::size_t getFinalResultIndex(TreeNodeType *root)
             {
                 std::stringstream ss;
                 ss << "Root chs:";
                 std::for_each(root->ch.begin(), root->ch.end(), [&](TreeNodeType &tn) {
-                    ss << "[visit_cnt=" << tn.block.visit_cnt.load() << ", Q=" << tn.block.getQ() <<
+                    PackedStats::Snapshot stats = tn.edge->stats.load();
+                    ss << "[visit_cnt=" << stats.visit_cnt << ", Q=" << stats.getQ() <<
                        ", uct=" << uctVal(tn) << "], ";
                 });
                 logger->debug(ss.str());
+                if (transpositionTable)
+                {
+                    TranspositionStats stats = transpositionTable->getStats();
+                    logger->debug("Transposition table: {} lookups, hit rate {}, {} replacements",
+                                  stats.lookup_cnt, stats.hitRate(), stats.replace_cnt);
+                }
+                if (cnnCache)
+                {
+                    CNNCacheStats stats = cnnCache->getStats();
+                    logger->debug("CNN cache: {} hits, {} misses, {} entries ({} bytes)",
+                                  stats.hit_cnt, stats.miss_cnt, stats.entry_cnt, stats.bytes);
+                }
                 return (std::size_t)
                         (std::max_element(root->ch.cbegin(), root->ch.cend(), [](const TreeNodeType&n1, const TreeNodeType &n2) {
-                            return n1.block.visit_cnt.load() < n2.block.visit_cnt.load();
+                            return n1.edge->stats.getVisitCnt() < n2.edge->stats.getVisitCnt();
                         }) - root->ch.cbegin());
             }
 
-            virtual TreeNodeType getRoot() override
+            bool isChildAction(const TreeNodeType &child, const PointType &action) const
+            {
+                return child.block.action == action;
+            }
+
+            // Called by Tree::advance; not thread-safe against a running search
+            void advanceRoot(const PointType &action)
+            {
+                init_board.place(action, init_player);
+                init_player = board::getOpponentPlayer(init_player);
+            }
+
+            TreeNodeType getRoot()
             {
                 return TreeNodeType {nullptr, init_player, PointType(0, 0)};
             }
         };
     }
 
-    template <std::size_t W, std::size_t H>
-    using UCTTree = Tree< detail::UCTTreePolicy<W, H> >;
+    template <std::size_t W, std::size_t H, typename SelectionT = detail::UCB1Selection>
+    using UCTTree = Tree< detail::UCTTreePolicy<W, H, SelectionT> >;
 }
 #endif //LIBUCT_UCT_ALGO_HPP
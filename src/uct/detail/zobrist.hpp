@@ -0,0 +1,90 @@
+//
+// Created by lz on 1/16/17.
+//
+
+#ifndef LIBUCT_ZOBRIST_HPP
+#define LIBUCT_ZOBRIST_HPP
+
+#include "message.pb.h"
+#include <board.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+
+namespace uct
+{
+    namespace detail
+    {
+        // Zobrist keys for a WxH board. Positions are hashed from the planes of their RequestV2, which is the one
+        // view of a board we always have at hand when it is about to be evaluated.
+        template<std::size_t W, std::size_t H>
+        class Zobrist
+        {
+            std::uint64_t stone[W * H][2]; // [point][0: black, 1: white]
+            std::uint64_t ko[W * H];
+            std::uint64_t white_to_move;
+            std::uint64_t recent[W * H][7]; // [point][stone played k + 1 moves ago], the turns-since planes
+
+            Zobrist()
+            {
+                std::mt19937_64 gen(0x9e3779b97f4a7c15ULL); // fixed, so keys are stable across runs
+                for (std::size_t i=0; i<W * H; ++i)
+                {
+                    stone[i][0] = gen();
+                    stone[i][1] = gen();
+                    ko[i] = gen();
+                }
+                white_to_move = gen();
+                for (std::size_t i=0; i<W * H; ++i) // drawn last, so the keys above don't change with them
+                    for (std::size_t k=0; k<7; ++k)
+                        recent[i][k] = gen();
+            }
+        public:
+            static const Zobrist &instance()
+            {
+                static const Zobrist z;
+                return z;
+            }
+
+            // Hash of the position described by req, where `to_move` is the player req was generated for.
+            // mapping(i) gives the point that plane index i is hashed as (used for board symmetries).
+            // with_history also hashes the turns-since planes (how many moves ago each stone was played; "more than
+            // seven" follows from the stones). The CNN sees them, so a cache of its answers must tell such requests
+            // apart, while transpositions reach one position through different move orders and leave them out.
+            template<typename MappingT>
+            std::uint64_t hashRequest(const gocnn::RequestV2 &req, board::Player to_move, MappingT mapping,
+                                      bool with_history = false) const
+            {
+                const google::protobuf::RepeatedField<bool> *history[7] = {
+                        &req.turns_since_one(), &req.turns_since_two(), &req.turns_since_three(),
+                        &req.turns_since_four(), &req.turns_since_five(), &req.turns_since_six(),
+                        &req.turns_since_seven()};
+                const int ours = to_move == board::Player::B ? 0 : 1;
+                std::uint64_t h = to_move == board::Player::W ? white_to_move : 0;
+                for (std::size_t i=0; i<W * H; ++i)
+                {
+                    std::size_t p = mapping(i);
+                    if (req.stone_color_our(i))
+                        h ^= stone[p][ours];
+                    else if (req.stone_color_oppo(i))
+                        h ^= stone[p][1 - ours];
+                    if (i < (std::size_t) req.ko_size() && req.ko(i))
+                        h ^= ko[p];
+                    if (with_history)
+                        for (std::size_t k=0; k<7; ++k)
+                            if ((int) i < history[k]->size() && history[k]->Get((int) i))
+                                h ^= recent[p][k];
+                }
+                return h;
+            }
+
+            std::uint64_t hashRequest(const gocnn::RequestV2 &req, board::Player to_move,
+                                      bool with_history = false) const
+            {
+                return hashRequest(req, to_move, [](std::size_t i) { return i; }, with_history);
+            }
+        };
+    }
+}
+
+#endif //LIBUCT_ZOBRIST_HPP
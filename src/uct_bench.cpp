@@ -0,0 +1,429 @@
+//
+// Created by lz on 1/20/17.
+//
+// Micro benchmarks for libuct. Usage: uct-bench [benchmark] [iterations]; runs every benchmark without arguments.
+//
+
+#include "uct/detail/cnn_v1.hpp"
+#include "uct/uct.hpp"
+#include <boost/asio.hpp>
+#include <boost/crc.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace boost::asio;
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    double elapsed_ms(Clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    }
+
+    // Keep-alive CNN server answering every frame with the same ResponseV2
+    class EchoServer
+    {
+        io_service service;
+        ip::tcp::acceptor acceptor;
+        const std::string reply;
+        const bool crc;
+        std::thread thread;
+    public:
+        EchoServer(unsigned short port, const std::string &reply, bool crc):
+                acceptor(service, ip::tcp::endpoint(ip::address::from_string("127.0.0.1"), port)),
+                reply(reply), crc(crc)
+        {
+            thread = std::thread([this]() {
+                ip::tcp::socket sock(service);
+                acceptor.accept(sock);
+                std::vector<char> buf;
+                boost::crc_32_type sum;
+                sum.process_bytes(this->reply.data(), this->reply.size());
+                std::uint32_t reply_crc = sum.checksum();
+                std::int64_t reply_len = this->reply.size();
+                std::array<const_buffer, 3> frame {{ buffer(&reply_len, 8), buffer(this->reply),
+                                                     this->crc ? buffer(&reply_crc, 4) : const_buffer() }};
+                for (;;)
+                {
+                    boost::system::error_code ec;
+                    std::int64_t len;
+                    read(sock, buffer(&len, 8), ec);
+                    if (ec)
+                        break;
+                    buf.resize(len + (this->crc ? 4 : 0));
+                    read(sock, buffer(buf));
+                    write(sock, frame);
+                }
+            });
+        }
+
+        ~EchoServer()
+        {
+            thread.join();
+        }
+    };
+
+    gocnn::RequestV2 make_request(std::size_t board_size)
+    {
+        gocnn::RequestV2 req;
+        req.set_board_size(board_size);
+        for (std::size_t i=0; i<board_size; ++i)
+        {
+            req.add_stone_color_our(i % 5 == 0);
+            req.add_stone_color_oppo(i % 5 == 1);
+            req.add_stone_color_empty(i % 5 > 1);
+            req.add_sensibleness(i % 5 > 1);
+            req.add_position(1.0f);
+        }
+        return req;
+    }
+
+    // Back-to-back framed calls of RequestV2ServiceCompact against a local server
+    void bench_framed_calls(std::size_t iterations)
+    {
+        const std::size_t BS = 361;
+        gocnn::ResponseV2 resp;
+        resp.set_board_size(BS);
+        for (std::size_t i=0; i<BS; ++i)
+            resp.add_possibility(1.0f / BS);
+        const std::string reply = resp.SerializeAsString();
+        const gocnn::RequestV2 req = make_request(BS);
+
+        unsigned short port = 7700;
+        for (auto format: {uct::detail::WireFormat::BYTE_PLANES, uct::detail::WireFormat::BIT_PLANES})
+            for (bool crc: {false, true})
+            {
+                EchoServer server(port, reply, crc);
+                uct::detail::FrameConfig frame;
+                frame.crc = crc;
+                uct::detail::RequestV2ServiceCompact service("127.0.0.1", port++,
+                                                             uct::detail::ConnectionMode::KEEP_ALIVE, format, frame);
+                std::vector<float> possibility;
+                service.sync_call(req, possibility); // connect and warm the buffers up
+                const std::size_t request_bytes = format == uct::detail::WireFormat::BYTE_PLANES ?
+                                                  service.compact_size(BS) : service.packed_size(BS);
+
+                auto start = Clock::now();
+                for (std::size_t i=0; i<iterations; ++i)
+                    service.sync_call(req, possibility);
+                double ms = elapsed_ms(start);
+                uct::detail::CNNLatencyStats stats = service.getLatencyStats();
+                std::cout << "framed_calls format=" << (format == uct::detail::WireFormat::BYTE_PLANES ? "bytes" : "bits")
+                          << " crc=" << crc << ": " << iterations * 1000.0 / ms << " calls/s, "
+                          << iterations * (request_bytes + reply.size()) / ms / 1000.0 << " MB/s, p50 "
+                          << stats.p50_ms << "ms, p99 " << stats.p99_ms << "ms" << std::endl;
+            }
+    }
+
+    using SelectionNode = uct::detail::TreeNodeWithBlock<uct::detail::UCTTreeNodeBlock<19, 19>,
+            uct::detail::ChBufSize(19, 19), uct::detail::UCTEdge>;
+
+    // The statistics embedded in every child node, as before the hot/cold split
+    struct InlineStatsNode
+    {
+        uct::detail::UCTEdge stats;
+        SelectionNode node;
+
+        InlineStatsNode():
+                node(nullptr, board::Player::W, board::GridPoint<19, 19>(0, 0))
+        {}
+    };
+
+    double ucb(const uct::detail::UCTEdge &e, double log_parent)
+    {
+        uct::detail::PackedStats::Snapshot stats = e.stats.load(std::memory_order_relaxed);
+        double visit_cnt = stats.visit_cnt;
+        return stats.getQ() / visit_cnt + 0.5 * std::sqrt(2 * log_parent / visit_cnt);
+    }
+
+    void fill_stats(uct::detail::UCTEdge &e, std::mt19937 &rng)
+    {
+        e.stats.store(1 + rng() % 1000, (float) (rng() % 1000) / 1000.0f);
+        e.default_policy_done.store(true);
+    }
+
+    // Children scored per second when picking the best of 45 children under parents visited in random order,
+    // with the statistics in packed edges and, for comparison, inline in the child nodes
+    void bench_selection(std::size_t iterations)
+    {
+        const std::size_t PARENTS = 16384, CH = uct::detail::ChBufSize(19, 19);
+        std::mt19937 rng(42);
+        std::vector<std::size_t> order(iterations);
+        for (auto &o: order)
+            o = rng() % PARENTS;
+
+        uct::detail::NodeArena arena;
+        std::vector<std::unique_ptr<SelectionNode>> parents;
+        std::vector<std::unique_ptr<InlineStatsNode[]>> inline_parents;
+        for (std::size_t p=0; p<PARENTS; ++p)
+        {
+            parents.emplace_back(new SelectionNode(nullptr, board::Player::B, board::GridPoint<19, 19>(0, 0)));
+            inline_parents.emplace_back(new InlineStatsNode[CH]);
+            for (std::size_t i=0; i<CH; ++i)
+            {
+                SelectionNode &c = parents.back()->emplace_child(arena, board::Player::W,
+                                                                 board::GridPoint<19, 19>(i / 19, i % 19));
+                fill_stats(*c.edge, rng);
+                inline_parents.back()[i].stats = *c.edge;
+            }
+        }
+
+        std::size_t checksum = 0;
+        auto start = Clock::now();
+        for (std::size_t p: order)
+        {
+            const uct::detail::UCTEdge *edges = &parents[p]->ch.edge(0); // one chunk: emplace_child reserves CH
+            double log_parent = std::log(1000.0 + p);
+            std::size_t best = 0;
+            double best_val = -1e100;
+            for (std::size_t i=0; i<CH; ++i)
+            {
+                double v = ucb(edges[i], log_parent);
+                if (v > best_val)
+                    best_val = v, best = i;
+            }
+            checksum += best;
+        }
+        double packed_ms = elapsed_ms(start);
+
+        start = Clock::now();
+        for (std::size_t p: order)
+        {
+            const InlineStatsNode *children = inline_parents[p].get();
+            double log_parent = std::log(1000.0 + p);
+            std::size_t best = 0;
+            double best_val = -1e100;
+            for (std::size_t i=0; i<CH; ++i)
+            {
+                double v = ucb(children[i].stats, log_parent);
+                if (v > best_val)
+                    best_val = v, best = i;
+            }
+            checksum -= best;
+        }
+        double inline_ms = elapsed_ms(start);
+
+        std::cout << "selection children=" << CH << " edge=" << sizeof(uct::detail::UCTEdge) << "B node="
+                  << sizeof(SelectionNode) << "B: packed edges " << iterations * CH / packed_ms / 1000.0
+                  << "M nodes/s, inline stats " << iterations * CH / inline_ms / 1000.0 << "M nodes/s"
+                  << (checksum ? " (mismatch!)" : "") << std::endl;
+    }
+
+    // Best of 45 children of a few cache-resident parents: select_ucb against the per-child double evaluation
+    // into a fresh vector that tree_policy used before (std::log of the parent visits for every child)
+    void bench_ucb_argmax(std::size_t iterations)
+    {
+        const std::size_t PARENTS = 64, CH = uct::detail::ChBufSize(19, 19);
+        std::mt19937 rng(7);
+        std::vector<uct::detail::UCTEdge> edges(PARENTS * CH), parent_edges(PARENTS);
+        for (auto &e: edges)
+        {
+            fill_stats(e, rng);
+            e.virtual_loss_cnt.store(rng() % 8 == 0 ? 1 : 0);
+        }
+        for (auto &e: parent_edges)
+            e.stats.store(CH * 1000 + rng() % 1000, 0.0f);
+        const double virtual_loss = 1.0;
+
+        std::size_t scalar_sum = 0, simd_sum = 0; // of the chosen indices
+        auto start = Clock::now();
+        for (std::size_t it=0; it<iterations; ++it)
+        {
+            const std::size_t p = it % PARENTS;
+            std::vector<double> uctValue;
+            uctValue.reserve(CH);
+            for (std::size_t i=0; i<CH; ++i)
+            {
+                const uct::detail::UCTEdge &e = edges[p * CH + i];
+                uct::detail::PackedStats::Snapshot stats = e.stats.load();
+                double visit_cnt = stats.visit_cnt, q = stats.getQ();
+                double loss = e.virtual_loss_cnt.load() * virtual_loss;
+                visit_cnt += loss;
+                q -= loss;
+                uctValue.push_back(q / visit_cnt +
+                                   0.5 * std::sqrt(2 * std::log(parent_edges[p].stats.getVisitCnt()) / visit_cnt));
+            }
+            scalar_sum += std::max_element(uctValue.begin(), uctValue.end()) - uctValue.begin();
+        }
+        double scalar_ms = elapsed_ms(start);
+
+        start = Clock::now();
+        for (std::size_t it=0; it<iterations; ++it)
+        {
+            const std::size_t p = it % PARENTS;
+            uct::detail::SelectParams params;
+            params.exploration = 2.0f * std::log((float) parent_edges[p].stats.getVisitCnt());
+            params.virtual_loss = (float) virtual_loss;
+            params.virtual_loss_ratio = 0.0f;
+            simd_sum += uct::detail::select_ucb(&edges[p * CH], CH, params);
+        }
+        double simd_ms = elapsed_ms(start);
+
+        std::cout << "ucb_argmax children=" << CH << ": per-child double " << iterations * CH / scalar_ms / 1000.0
+                  << "M nodes/s, select_ucb " << iterations * CH / simd_ms / 1000.0 << "M nodes/s"
+#if defined(__AVX2__)
+                  << " (AVX2)"
+#elif defined(__SSE2__)
+                  << " (SSE2)"
+#endif
+                  << (scalar_sum != simd_sum ? " (choices differ)" : "") << std::endl;
+    }
+
+    using DispatchPolicy = uct::detail::UCTTreePolicy<9, 9>;
+    using DispatchBase = uct::TreePolicy<DispatchPolicy::BlockType, DispatchPolicy::CH_BUF_SIZE,
+            DispatchPolicy::TreeState, DispatchPolicy::EdgeType>;
+
+    // UCTTreePolicy behind the virtual TreePolicy interface, as Tree drove it before StaticTreePolicy
+    struct VirtualUCTPolicy: DispatchBase
+    {
+        DispatchPolicy &impl;
+
+        explicit VirtualUCTPolicy(DispatchPolicy &impl): impl(impl)
+        {}
+
+        virtual TreePolicyResult tree_policy(TreeNodeType *root) override
+        {
+            return impl.tree_policy(root);
+        }
+
+        virtual void default_policy(const TreePolicyResult &result) override
+        {
+            impl.default_policy(result);
+        }
+
+        virtual std::size_t getFinalResultIndex(TreeNodeType *root) override
+        {
+            return impl.getFinalResultIndex(root);
+        }
+
+        virtual TreeNodeType getRoot() override
+        {
+            return impl.getRoot();
+        }
+    };
+
+    // Milliseconds for iterations rounds of Tree::single_thread_runner's loop, one thread, on a fresh 9x9 tree,
+    // calling the policy through its virtual base or on the concrete type
+    template<bool virtual_calls>
+    double time_search_loop(std::size_t iterations)
+    {
+        uct::detail::ConvLayer layer {39, 1, 1, false, std::vector<float>(39, 0.0f), std::vector<float>(1, 0.0f)};
+        layer.weights[37] = 2.0f; // border plane
+        uct::detail::UCTConfig config;
+        config.evaluator = std::make_shared<uct::detail::ConvPolicyEvaluator>(
+                9, 9, std::vector<uct::detail::ConvLayer> {layer});
+        config.seed = 1; // both loops grow the same tree
+        board::Board<9, 9> b;
+        DispatchPolicy policy(b, board::Player::B, 6.5, config);
+        VirtualUCTPolicy wrapper(policy);
+        DispatchBase *volatile opaque = &wrapper; // keeps the compiler from resolving the virtual calls
+        DispatchBase *base = opaque;
+
+        uct::detail::NodeArena arena; // must outlive root
+        DispatchPolicy::TreeNodeType root = policy.getRoot();
+        DispatchPolicy::EdgeType root_edge {};
+        root.edge = &root_edge;
+        policy.node_arena = &arena;
+        policy.default_policy(std::make_pair(&root, DispatchPolicy::TreeState {}));
+        policy.onSearchBegin(Clock::time_point::max());
+
+        auto start = Clock::now();
+        for (std::size_t it=0; it<iterations; ++it)
+        {
+            DispatchPolicy::TreePolicyResult result = virtual_calls ? base->tree_policy(&root) :
+                                                      policy.DispatchPolicy::tree_policy(&root);
+            if (!result.first)
+                continue;
+            if (virtual_calls)
+                base->default_policy(result);
+            else
+                policy.DispatchPolicy::default_policy(result);
+        }
+        double ms = elapsed_ms(start);
+        policy.onSearchEnd();
+        return ms;
+    }
+
+    // Iterations per second of the UCT search loop calling the policy through its virtual base, as Tree used to,
+    // and on the concrete type, as Tree does now
+    void bench_policy_dispatch(std::size_t iterations)
+    {
+        double virtual_ms = time_search_loop<true>(iterations);
+        double static_ms = time_search_loop<false>(iterations);
+        std::cout << "policy_dispatch 9x9 UCTTreePolicy: virtual " << virtual_ms * 1e6 / iterations
+                  << "ns/iteration, static " << static_ms * 1e6 / iterations << "ns/iteration" << std::endl;
+    }
+
+    // Arena bytes per tree node after a fixed number of 19x19 playouts, without and with progressive widening.
+    // Runs without a CNN server: an in-process 1x1 network preferring points next to the border.
+    void bench_widening_memory(std::size_t iterations)
+    {
+        uct::detail::ConvLayer layer {39, 1, 1, false, std::vector<float>(39, 0.0f), std::vector<float>(1, 0.0f)};
+        layer.weights[37] = 2.0f; // border plane
+        uct::SearchLimits limits;
+        limits.early_stop = false;
+        limits.max_playouts = iterations;
+
+        for (double widening_k: {0.0, 1.0})
+        {
+            uct::detail::UCTConfig config;
+            config.evaluator = std::make_shared<uct::detail::ConvPolicyEvaluator>(
+                    19, 19, std::vector<uct::detail::ConvLayer> {layer});
+            config.widening_k = widening_k;
+            board::Board<19, 19> b;
+            uct::UCTTree<19, 19> tree(b, board::Player::B, 6.5, config);
+            tree.run(1, limits);
+
+            using NodeT = uct::UCTTree<19, 19>::TreeNodeType;
+            std::size_t nodes = 0, expanded = 0, slots = 0;
+            std::vector<NodeT *> stack {tree.getRootNode()};
+            while (!stack.empty())
+            {
+                NodeT *node = stack.back();
+                stack.pop_back();
+                ++nodes;
+                if (!node->ch.empty())
+                    ++expanded;
+                slots += node->ch.reserved();
+                for (auto &c: node->ch)
+                    stack.push_back(&c);
+            }
+            std::size_t bytes = tree.getPolicy().node_arena->getUsedBytes();
+            std::cout << "widening_memory widening_k=" << widening_k << " playouts=" << iterations << ": " << nodes
+                      << " nodes, " << (double) slots / std::max<std::size_t>(1, expanded)
+                      << " slots per expanded node, " << (double) bytes / std::max<std::size_t>(1, nodes)
+                      << " bytes per node" << std::endl;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const std::string which = argc > 1 ? argv[1] : "";
+    const std::size_t iterations = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 0;
+
+    const std::vector<std::pair<std::string, std::pair<std::function<void(std::size_t)>, std::size_t>>> benchmarks {
+            {"framed_calls", {bench_framed_calls, 20000}},
+            {"selection", {bench_selection, 1000000}},
+            {"ucb_argmax", {bench_ucb_argmax, 1000000}},
+            {"policy_dispatch", {bench_policy_dispatch, 20000}},
+            {"widening_memory", {bench_widening_memory, 20000}},
+    };
+    for (const auto &b: benchmarks)
+        if (which.empty() || which == b.first)
+            b.second.first(iterations ? iterations : b.second.second);
+    return 0;
+}
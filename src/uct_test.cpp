@@ -1,25 +1,35 @@
 #include <gtest/gtest.h>
 #include <logger.hpp>
 #include "uct/uct.hpp"
+#include <algorithm>
 #include <atomic>
+#include <future>
+#include <memory>
 #include <mutex>
 #include <thread>
+#include <vector>
 #include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <chrono>
+#include <cmath>
+#include <random>
 #include <boost/pool/pool.hpp>
 #include <boost/asio.hpp>
 
 struct TreeNodeBlock1
 {
     std::atomic<int> visit_cnt {0};
-    std::mutex expand_mutex;
     std::atomic_bool default_policy_done {false};
 
     TreeNodeBlock1() = default;
     TreeNodeBlock1(const TreeNodeBlock1& other):
             visit_cnt(other.visit_cnt.load()), default_policy_done(false)
     {}
+    // used when Tree::advance promotes a child to root
+    TreeNodeBlock1(TreeNodeBlock1&& other):
+            visit_cnt(other.visit_cnt.load()), default_policy_done(other.default_policy_done.load())
+    {}
 };
 
 struct TreePolicy1: public uct::TreePolicy<TreeNodeBlock1, 32>
@@ -46,20 +56,15 @@ struct TreePolicy1: public uct::TreePolicy<TreeNodeBlock1, 32>
                 continue;
             }
 
-            if (cur_node->ch.size() < 32) {
-                std::lock_guard<std::mutex> lock(cur_node->block.expand_mutex);
-                if (cur_node->ch.size() < 32)
-                {
-                    cur_node->ch.emplace_back(cur_node);
-                    expanded_ch = &*cur_node->ch.rbegin();
-                }
-            }
+            std::size_t index;
+            if (cur_node->claim_child(*node_arena, 32, 32, index))
+                expanded_ch = &cur_node->emplace_claimed_child(index);
             if (expanded_ch)
             {
                 return std::make_pair(expanded_ch, TreeState {});
             } else
             {
-                cur_node = &*(cur_node->ch.begin() + (std::rand() % cur_node->ch.size()));
+                cur_node = &cur_node->ch[std::rand() % cur_node->ch.size()];
             }
         }
     }
@@ -97,6 +102,679 @@ TEST(TreeTest, TestTree1)
     tree.run(4, std::chrono::seconds(2));
 }
 
+// Actions are child indices
+struct TreePolicy1Advance: public TreePolicy1
+{
+    bool isChildAction(const TreeNodeType &child, std::size_t index) const
+    {
+        return &child == &child.parent->ch[index];
+    }
+
+    void advanceRoot(std::size_t) {}
+};
+
+TEST(TreeTest, TestAdvanceKeepsSubtree)
+{
+    uct::Tree<TreePolicy1Advance> tree;
+    tree.run(2, std::chrono::milliseconds(200));
+    auto *old_child = &tree.getRootNode()->ch[3];
+    int visits = old_child->block.visit_cnt.load();
+    std::size_t grand_children = old_child->ch.size();
+    ASSERT_GT(grand_children, 0u);
+
+    EXPECT_TRUE(tree.advance(std::size_t(3)));
+    auto *root = tree.getRootNode();
+    EXPECT_EQ(nullptr, root->parent);
+    EXPECT_EQ(visits, root->block.visit_cnt.load());
+    ASSERT_EQ(grand_children, root->ch.size());
+    for (auto &c: root->ch)
+        EXPECT_EQ(root, c.parent);
+
+    tree.run(2, std::chrono::milliseconds(100)); // keeps searching while the old tree is being freed
+    EXPECT_GT(root->block.visit_cnt.load(), visits);
+}
+
+TEST(TreeTest, TestPonderingKeepsSubtree)
+{
+    uct::Tree<TreePolicy1Advance> tree;
+    tree.startSearch(2); // ponder until the opponent's move arrives
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::size_t pondered = tree.getSearchIterationCount();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    EXPECT_TRUE(tree.isSearching());
+    EXPECT_GT(tree.getSearchIterationCount(), pondered); // still searching, not just still holding the batch
+    EXPECT_THROW(tree.startSearch(1), std::logic_error);
+
+    EXPECT_TRUE(tree.advance(std::size_t(3))); // stops pondering first
+    EXPECT_FALSE(tree.isSearching());
+    EXPECT_GT(tree.getIterationCount(), 0u);
+    EXPECT_GT(tree.getRootNode()->block.visit_cnt.load(), 0);
+    tree.stop(); // nothing to stop
+
+    tree.startSearch(2, std::chrono::milliseconds(100));
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    EXPECT_FALSE(tree.isSearching()); // ended on its own, not closed yet
+    EXPECT_THROW(tree.startSearch(1), std::logic_error);
+    EXPECT_NE(nullptr, tree.waitResult());
+    EXPECT_FALSE(tree.isSearching());
+}
+
+TEST(TreeTest, TestSharedPoolWhilePondering)
+{
+    auto pool = std::make_shared<uct::detail::SearchThreadPool>(2);
+    uct::Tree<TreePolicy1Advance> pondering, searching;
+    pondering.setThreadPool(pool);
+    searching.setThreadPool(pool);
+    pondering.startSearch(2); // holds both workers until stopped
+
+    auto finished = std::async(std::launch::async, [&]() {
+        searching.run(2, std::chrono::milliseconds(100));
+    });
+    ASSERT_EQ(std::future_status::ready, finished.wait_for(std::chrono::seconds(5))); // on workers the pool added
+    finished.get();
+    EXPECT_GT(searching.getIterationCount(), 0u);
+    EXPECT_TRUE(pondering.isSearching());
+    EXPECT_EQ(4u, pool->size());
+
+    pondering.stop();
+    searching.run(2, std::chrono::milliseconds(50));
+    EXPECT_EQ(4u, pool->size()); // idle workers are enough now
+}
+
+// Two root children; playouts go to the first one only (lopsided) or to both in turn
+struct TwoChildPolicy: public uct::StaticTreePolicy<TreeNodeBlock1, 2>
+{
+    bool lopsided = true;
+    std::atomic<int> turn {0};
+
+    TreePolicyResult tree_policy(TreeNodeType *root)
+    {
+        std::size_t index;
+        while (root->claim_child(*node_arena, 2, 2, index))
+            root->emplace_claimed_child(index);
+        while (root->ch.size() < 2)
+            std::this_thread::yield(); // another thread is publishing
+        return std::make_pair(&root->ch[lopsided ? 0 : turn.fetch_add(1) % 2], TreeState {});
+    }
+
+    void default_policy(const TreePolicyResult &result)
+    {
+        for (TreeNodeType *node = result.first; node; node = node->parent)
+            node->block.visit_cnt.fetch_add(1);
+    }
+
+    int getVisitCount(const TreeNodeType &node) const
+    {
+        return node.block.visit_cnt.load();
+    }
+
+    std::size_t getFinalResultIndex(TreeNodeType *root)
+    {
+        return root->ch[1].block.visit_cnt.load() > root->ch[0].block.visit_cnt.load();
+    }
+
+    TreeNodeType getRoot()
+    {
+        return TreeNodeType {nullptr};
+    }
+};
+
+TEST(TreeTest, TestSearchLimits)
+{
+    static_assert(uct::detail::HasVisitCount<TwoChildPolicy>::value, "early stop sees the visits");
+    static_assert(!uct::detail::HasVisitCount<TreePolicy1>::value, "TreePolicy1 can't tell");
+    using Clock = std::chrono::steady_clock;
+
+    uct::SearchLimits playouts;
+    playouts.max_playouts = 500;
+    uct::Tree<TreePolicy1> budget_tree;
+    budget_tree.run(1, playouts);
+    EXPECT_EQ(500u, budget_tree.getIterationCount() - budget_tree.getWastedIterationCount());
+
+    uct::SearchLimits nodes;
+    nodes.max_nodes = 300;
+    uct::Tree<TreePolicy1Advance> node_tree;
+    node_tree.run(2, nodes);
+    std::size_t node_cnt = node_tree.getPolicy().node_arena->getNodeCount();
+    EXPECT_GE(node_cnt, 300u);
+    EXPECT_LE(node_cnt, 300u + 2 * 100); // one check interval per thread at most
+    node_tree.advance(std::size_t(0));
+    node_tree.run(2, nodes); // the old tree, still being freed, doesn't count
+    node_cnt = node_tree.getPolicy().node_arena->getNodeCount();
+    EXPECT_GE(node_cnt, 300u);
+    EXPECT_LE(node_cnt, 300u + 2 * 100);
+
+    uct::SearchLimits early;
+    early.time_limit = std::chrono::milliseconds(1000);
+    uct::Tree<TwoChildPolicy> lopsided;
+    auto start = Clock::now();
+    lopsided.run(2, early); // the second child can't catch up after half the time
+    EXPECT_LT(Clock::now() - start, std::chrono::milliseconds(900));
+    EXPECT_EQ(0, lopsided.getRootNode()->ch[1].block.visit_cnt.load());
+
+    uct::SearchLimits extended;
+    extended.time_limit = std::chrono::milliseconds(100);
+    extended.max_time = std::chrono::milliseconds(300);
+    uct::Tree<TwoChildPolicy> close;
+    close.getPolicy().lopsided = false;
+    start = Clock::now();
+    close.run(2, extended); // a close call all along: takes the extension
+    EXPECT_GE(Clock::now() - start, std::chrono::milliseconds(300));
+}
+
+TEST(ArenaTest, TestChildRangesAreRecycled)
+{
+    using NodeT = uct::detail::TreeNodeWithBlock<int, 8>;
+    uct::detail::NodeArena arena;
+    NodeT root(nullptr, 0);
+    for (int i=0; i<8; ++i)
+        EXPECT_EQ(i, root.emplace_child(arena, i).block);
+    EXPECT_THROW(root.emplace_child(arena, 8), std::length_error);
+    EXPECT_EQ(&root, root.ch[7].parent);
+    EXPECT_EQ(0u, reinterpret_cast<std::uintptr_t>(&root.ch[0]) % uct::detail::NodeArena::ALIGN);
+
+    NodeT *range = &root.ch[0];
+    NodeT moved(std::move(root));
+    EXPECT_EQ(range, &moved.ch[0]);
+    EXPECT_EQ(&moved, moved.ch[0].parent);
+    EXPECT_TRUE(root.ch.empty());
+
+    std::size_t used = arena.getUsedBytes();
+    moved.ch.release(arena);
+    EXPECT_LT(arena.getUsedBytes(), used);
+    moved.emplace_child(arena, 42);
+    EXPECT_EQ(range, &moved.ch[0]); // the released range is handed out again
+}
+
+TEST(ArenaTest, TestConcurrentExpansionPublishesInOrder)
+{
+    using NodeT = uct::detail::TreeNodeWithBlock<int, 64>;
+    uct::detail::NodeArena arena;
+    NodeT root(nullptr, -1);
+    std::atomic<bool> bad_read {false};
+    std::vector<std::thread> threads;
+    for (int t=0; t<8; ++t)
+        threads.emplace_back([&]() {
+            std::size_t index;
+            while (root.claim_child(arena, 64, 64, index))
+            {
+                root.emplace_claimed_child(index, (int) index);
+                for (std::size_t i=0; i<root.ch.size(); ++i) // every published child is fully built
+                    if (root.ch[i].block != (int) i || root.ch[i].parent != &root)
+                        bad_read = true;
+            }
+        });
+    for (auto &t: threads)
+        t.join();
+    EXPECT_FALSE(bad_read.load());
+    ASSERT_EQ(64u, root.ch.size());
+    for (int i=0; i<64; ++i)
+        EXPECT_EQ(i, root.ch[i].block);
+    std::size_t index;
+    EXPECT_FALSE(root.claim_child(arena, 64, 64, index));
+}
+
+TEST(ArenaTest, TestEdgesArePackedPerParent)
+{
+    using NodeT = uct::detail::TreeNodeWithBlock<int, 8, uct::detail::UCTEdge>;
+    uct::detail::NodeArena arena;
+    NodeT root(nullptr, 0);
+    for (int i=0; i<5; ++i)
+        root.emplace_child(arena, i).edge->stats.store(i, 0.0f);
+    const uct::detail::UCTEdge *edges = &root.ch.edge(0); // one chunk: emplace_child reserves ch_buf_size
+    for (int i=0; i<5; ++i)
+    {
+        EXPECT_EQ(edges + i, root.ch[i].edge);
+        EXPECT_EQ((std::uint32_t) i, edges[i].stats.getVisitCnt());
+    }
+    EXPECT_EQ(0u, edges[5].stats.getVisitCnt()); // unclaimed slots start zeroed
+    EXPECT_GE(reinterpret_cast<const char *>(edges), reinterpret_cast<const char *>(&root.ch[0] + 8));
+
+    NodeT moved(std::move(root)); // children keep their edges
+    EXPECT_EQ(edges + 3, moved.ch[3].edge);
+}
+
+TEST(ArenaTest, TestChildRangeGrowsInChunks)
+{
+    using NodeT = uct::detail::TreeNodeWithBlock<int, 8, uct::detail::UCTEdge>;
+    uct::detail::NodeArena arena;
+    NodeT root(nullptr, 0);
+    std::vector<NodeT *> children;
+    std::size_t index;
+    for (std::size_t limit=1; limit<=100; ++limit) // admit one more child at a time
+    {
+        ASSERT_TRUE(root.claim_child(arena, 100, limit, index));
+        EXPECT_EQ(limit - 1, index);
+        children.push_back(&root.emplace_claimed_child(index, (int) index));
+        children.back()->edge->stats.store((std::uint32_t) index, 0.0f);
+        EXPECT_LE(root.ch.reserved(), std::max<std::size_t>(2 * limit, limit + 4));
+    }
+    EXPECT_FALSE(root.claim_child(arena, 100, 101, index));
+    EXPECT_EQ(100u, root.ch.reserved());
+
+    std::size_t i = 0;
+    for (auto &c: root.ch) // in index order across chunks, at the addresses they were built at
+    {
+        EXPECT_EQ(children[i], &c);
+        EXPECT_EQ((int) i, c.block);
+        EXPECT_EQ(&root.ch.edge(i), c.edge);
+        ++i;
+    }
+    EXPECT_EQ(100u, i);
+
+    std::size_t edge_cnt = 0, range_cnt = 0;
+    root.ch.edge_ranges(100, [&](const uct::detail::UCTEdge *edges, std::size_t first, std::size_t cnt) {
+        EXPECT_EQ(edge_cnt, first);
+        for (std::size_t j=0; j<cnt; ++j)
+            EXPECT_EQ((std::uint32_t) (first + j), edges[j].stats.getVisitCnt());
+        edge_cnt += cnt;
+        ++range_cnt;
+    });
+    EXPECT_EQ(100u, edge_cnt);
+    EXPECT_GE(6u, range_cnt); // 4, 4, 8, 16, 32, 36
+
+    std::size_t used = arena.getUsedBytes();
+    root.ch.release(arena);
+    EXPECT_LT(arena.getUsedBytes(), used);
+    EXPECT_TRUE(root.ch.empty());
+}
+
+TEST(PackedStatsTest, TestConcurrentUpdatesStayConsistent)
+{
+    uct::detail::PackedStats stats;
+    const int THREADS = 4, ADDS = 20000;
+    std::vector<std::thread> threads;
+    for (int t=0; t<THREADS; ++t)
+        threads.emplace_back([&stats, t]() {
+            for (int i=0; i<ADDS; ++i)
+                stats.add(t % 2 ? 1.0 : -1.0);
+        });
+    for (auto &t: threads)
+        t.join();
+    auto snapshot = stats.load();
+    EXPECT_EQ((std::uint32_t) (THREADS * ADDS), snapshot.visit_cnt);
+    EXPECT_NEAR(0.0, snapshot.mean, 1e-3);
+
+    stats.store(3000000000u, 0.25f); // beyond the range of the old 32-bit fixed-point Q
+    stats.add(0.25);
+    EXPECT_EQ(3000000001u, stats.getVisitCnt());
+    EXPECT_FLOAT_EQ(0.25f, stats.load().mean);
+
+    stats.store(1u << 25, 0.5f); // the float mean has stalled: a playout's share is below half an ulp
+    stats.add(1.0);
+    EXPECT_EQ(0.5f, stats.load().mean);
+}
+
+TEST(SearchPoolTest, TestWorkersAreReusedAndResized)
+{
+    uct::detail::SearchThreadPool pool(3);
+    std::mutex mutex;
+    std::vector<std::thread::id> first, second;
+    pool.run(3, [&](std::size_t) {
+        std::lock_guard<std::mutex> lock(mutex);
+        first.push_back(std::this_thread::get_id());
+    });
+    pool.run(3, [&](std::size_t) {
+        std::lock_guard<std::mutex> lock(mutex);
+        second.push_back(std::this_thread::get_id());
+    });
+    std::sort(first.begin(), first.end());
+    std::sort(second.begin(), second.end());
+    EXPECT_EQ(first, second); // the same three threads both times
+
+    pool.resize(1);
+    EXPECT_EQ(1u, pool.size());
+    EXPECT_THROW(pool.start(2, [](std::size_t) {}), std::invalid_argument);
+    pool.resize(4);
+    std::atomic<int> sum {0};
+    EXPECT_THROW(pool.run(4, [&](std::size_t i) {
+        sum.fetch_add((int) i);
+        if (i == 2)
+            throw std::runtime_error("job failed");
+    }), std::runtime_error);
+    EXPECT_EQ(6, sum.load()); // every job ran before the exception got through
+
+    std::atomic<bool> release {false};
+    auto held = pool.start(3, [&](std::size_t) {
+        while (!release.load())
+            std::this_thread::yield();
+    });
+    EXPECT_THROW(pool.start(2, [](std::size_t) {}), std::invalid_argument); // only one worker is idle
+    pool.run(2, [](std::size_t) {}, true);
+    EXPECT_EQ(5u, pool.size());
+    release.store(true);
+    pool.wait(held);
+
+    EXPECT_EQ((std::vector<int> {0, 1, 2, 3, 8, 10, 11}), uct::detail::parseCpuList("0-3,8,10-11\n"));
+    EXPECT_EQ((std::vector<int> {0, 4, 1, 5, 6}),
+              uct::detail::pinningOrder(uct::detail::ThreadPinning::SPREAD, {{0, 1}, {4, 5, 6}}));
+}
+
+TEST(UCBSelectTest, TestMatchesScalarArgmax)
+{
+    std::mt19937 rng(3);
+    uct::detail::SelectParams params;
+    params.exploration = 2.0f * std::log(5000.0f);
+    params.virtual_loss = 1.0f;
+    params.virtual_loss_ratio = 0.01f;
+    for (std::size_t n=1; n<=50; ++n)
+    {
+        std::vector<uct::detail::UCTEdge> edges(n);
+        for (auto &e: edges)
+        {
+            e.stats.store(1 + rng() % 500, (float) (rng() % 2001) / 1000.0f - 1.0f);
+            e.virtual_loss_cnt.store(rng() % 4 == 0 ? rng() % 3 : 0);
+            e.cnn_state.store(rng() % 8 == 0 ? uct::detail::UCTEdge::CNN_PENDING : uct::detail::UCTEdge::CNN_READY);
+            e.default_policy_done.store(rng() % 8 != 0);
+        }
+        if (n % 5 == 0) // a tie between an early and a late child: the first one wins
+            edges[n - 1] = edges[n / 2];
+
+        std::size_t expected = 0;
+        for (std::size_t i=1; i<n; ++i)
+            if (uct::detail::ucb_value(edges[i], params) > uct::detail::ucb_value(edges[expected], params))
+                expected = i;
+        EXPECT_EQ(expected, uct::detail::select_ucb(edges.data(), n, params)) << "n=" << n;
+    }
+}
+
+TEST(TranspositionTest, TestStoreLookupAndEviction)
+{
+    uct::detail::TranspositionTable<int> table(4); // two buckets of two slots
+    int out = 0;
+    EXPECT_EQ(nullptr, table.lookup(1, out));
+    auto *slot = table.store(1, 10);
+    ASSERT_NE(nullptr, table.lookup(1, out));
+    EXPECT_EQ(10, out);
+    slot->addStats(0.5);
+    EXPECT_EQ(1u, slot->stats.getVisitCnt());
+
+    table.store(3, 30); // same bucket as 1, free slot
+    table.lookup(3, out);
+    table.lookup(3, out);
+    table.store(5, 50); // bucket full: evicts key 1, which has fewer hits
+    EXPECT_FALSE(decltype(table)::holds(slot, 1));
+    EXPECT_EQ(nullptr, table.lookup(1, out));
+    ASSERT_NE(nullptr, table.lookup(3, out));
+    EXPECT_EQ(30, out);
+
+    uct::detail::TranspositionStats stats = table.getStats();
+    EXPECT_EQ(1u, stats.replace_cnt);
+    EXPECT_EQ(6u, stats.lookup_cnt);
+    EXPECT_EQ(4u, stats.hit_cnt);
+}
+
+// 9x9 request with one of our stones at (x, y)
+static gocnn::RequestV2 requestWithStone(std::size_t x, std::size_t y)
+{
+    gocnn::RequestV2 req;
+    req.set_board_size(81);
+    for (std::size_t i=0; i<81; ++i)
+    {
+        req.add_stone_color_our(i == x * 9 + y);
+        req.add_stone_color_oppo(false);
+    }
+    return req;
+}
+
+TEST(CNNCacheTest, TestSymmetricPositionsShareEntry)
+{
+    uct::detail::CNNResponseCache<9, 9> cache(64, true);
+    std::vector<float> probs(81, 0.0f), got;
+    probs[1 * 9 + 4] = 1.0f; // (1, 4)
+
+    gocnn::RequestV2 req = requestWithStone(2, 3);
+    EXPECT_FALSE(cache.lookup(req, board::Player::B, got));
+    cache.store(req, board::Player::B, probs.data(), probs.size());
+    ASSERT_TRUE(cache.lookup(req, board::Player::B, got));
+    EXPECT_EQ(probs, got);
+    EXPECT_FALSE(cache.lookup(req, board::Player::W, got)); // player to move is part of the position
+
+    // transposed board: the answer is transposed too
+    ASSERT_TRUE(cache.lookup(requestWithStone(3, 2), board::Player::B, got));
+    EXPECT_EQ(1.0f, got[4 * 9 + 1]);
+    // mirrored along x
+    ASSERT_TRUE(cache.lookup(requestWithStone(6, 3), board::Player::B, got));
+    EXPECT_EQ(1.0f, got[7 * 9 + 4]);
+
+    uct::detail::CNNCacheStats stats = cache.getStats();
+    EXPECT_EQ(3u, stats.hit_cnt);
+    EXPECT_EQ(2u, stats.miss_cnt);
+    EXPECT_EQ(1u, stats.entry_cnt);
+    EXPECT_EQ(81 * sizeof(float), stats.bytes);
+}
+
+TEST(CNNCacheTest, TestEvictsLeastRecentlyUsed)
+{
+    uct::detail::CNNResponseCache<9, 9> cache(16, false); // one entry per shard
+    std::vector<float> probs(81, 0.5f), got;
+    for (std::size_t i=0; i<81; ++i)
+        cache.store(requestWithStone(i / 9, i % 9), board::Player::B, probs.data(), probs.size());
+    EXPECT_GE(16u, cache.getStats().entry_cnt);
+    EXPECT_EQ(cache.getStats().entry_cnt * 81 * sizeof(float), cache.getStats().bytes);
+
+    // Three positions of one shard, in a cache holding two entries per shard
+    const auto &z = uct::detail::Zobrist<9, 9>::instance();
+    std::vector<gocnn::RequestV2> same_shard;
+    std::size_t shard = (z.hashRequest(requestWithStone(0, 0), board::Player::B, true) >> 7) % 16;
+    for (std::size_t i=0; i<81 && same_shard.size() < 3; ++i)
+    {
+        gocnn::RequestV2 req = requestWithStone(i / 9, i % 9);
+        if ((z.hashRequest(req, board::Player::B, true) >> 7) % 16 == shard)
+            same_shard.push_back(req);
+    }
+    ASSERT_EQ(3u, same_shard.size());
+
+    uct::detail::CNNResponseCache<9, 9> lru(32, false);
+    lru.store(same_shard[0], board::Player::B, probs.data(), probs.size());
+    lru.store(same_shard[1], board::Player::B, probs.data(), probs.size());
+    EXPECT_TRUE(lru.lookup(same_shard[0], board::Player::B, got)); // touch the older entry
+    lru.store(same_shard[2], board::Player::B, probs.data(), probs.size());
+    EXPECT_TRUE(lru.lookup(same_shard[0], board::Player::B, got));
+    EXPECT_FALSE(lru.lookup(same_shard[1], board::Player::B, got)); // least recently used
+    EXPECT_TRUE(lru.lookup(same_shard[2], board::Player::B, got));
+    EXPECT_EQ(2u, lru.getStats().entry_cnt);
+}
+
+TEST(CNNCacheTest, TestMoveHistoryIsPartOfKey)
+{
+    uct::detail::CNNResponseCache<9, 9> cache(64, true);
+    std::vector<float> probs(81, 0.5f), got;
+    gocnn::RequestV2 old_stone = requestWithStone(2, 3), new_stone = old_stone;
+    for (std::size_t i=0; i<81; ++i)
+        new_stone.add_turns_since_one(i == 2 * 9 + 3); // same stones, but the last move was played there
+    cache.store(old_stone, board::Player::B, probs.data(), probs.size());
+    EXPECT_FALSE(cache.lookup(new_stone, board::Player::B, got));
+    EXPECT_TRUE(cache.lookup(old_stone, board::Player::B, got));
+}
+
+// Search without a CNN server: an in-process 1x1 network preferring points next to the border
+static uct::detail::UCTConfig localEvaluatorConfig()
+{
+    uct::detail::ConvLayer layer {39, 1, 1, false, std::vector<float>(39, 0.0f), std::vector<float>(1, 0.0f)};
+    layer.weights[37] = 2.0f; // border plane
+    uct::detail::UCTConfig config;
+    config.evaluator = std::make_shared<uct::detail::ConvPolicyEvaluator>(
+            9, 9, std::vector<uct::detail::ConvLayer> {layer});
+    return config;
+}
+
+TEST(UCTTest, TestLocalEvaluator)
+{
+    uct::detail::UCTConfig config = localEvaluatorConfig();
+
+    board::Board<9, 9> b;
+    uct::Tree<uct::detail::UCTTreePolicy<9, 9>> tree(b, board::Player::B, 6.5, config);
+    tree.run(2, std::chrono::milliseconds(200));
+    EXPECT_LT(0u, tree.getIterationCount());
+    EXPECT_LT(0u, config.evaluator->getLatencyStats().call_cnt);
+}
+
+TEST(UCTTest, TestAdvanceKeepsCNNState)
+{
+    uct::detail::UCTConfig config = localEvaluatorConfig();
+    config.board_snapshot_interval = 1;
+    uct::SearchLimits limits;
+    limits.early_stop = false;
+    limits.max_playouts = 2000;
+
+    board::Board<9, 9> b;
+    uct::UCTTree<9, 9> tree(b, board::Player::B, 6.5, config);
+    tree.run(1, limits);
+    using NodeT = uct::UCTTree<9, 9>::TreeNodeType;
+    NodeT *child = nullptr;
+    for (auto &c: tree.getRootNode()->ch)
+        if (c.edge->cnn_state.load() == uct::detail::UCTEdge::CNN_READY && c.block.snapshot.load())
+            child = &c;
+    ASSERT_NE(nullptr, child);
+    const auto *good_pos = child->block.pGoodPos.get();
+    const auto *snapshot = child->block.snapshot.load();
+    const int try_before_cnn = child->block.try_before_cnn.load();
+    ASSERT_NE(nullptr, good_pos);
+
+    EXPECT_TRUE(tree.advance(child->block.action));
+    NodeT *root = tree.getRootNode();
+    EXPECT_EQ(good_pos, root->block.pGoodPos.get()); // moved, not copied
+    EXPECT_EQ(snapshot, root->block.snapshot.load());
+    EXPECT_EQ(try_before_cnn, root->block.try_before_cnn.load());
+    EXPECT_EQ((int) uct::detail::UCTEdge::CNN_READY, (int) root->edge->cnn_state.load());
+}
+
+TEST(UCTTest, TestSameSeedSameRollouts)
+{
+    uct::detail::UCTConfig config = localEvaluatorConfig();
+    config.seed = 12345;
+
+    uct::SearchLimits limits;
+    limits.time_limit = std::chrono::seconds(10);
+    limits.early_stop = false;
+    limits.max_playouts = 64;
+
+    board::Board<9, 9> b;
+    uct::UCTTree<9, 9> tree1(b, board::Player::B, 6.5, config), tree2(b, board::Player::B, 6.5, config);
+    config.seed = 54321;
+    uct::UCTTree<9, 9> tree3(b, board::Player::B, 6.5, config);
+    tree1.run(1, limits);
+    tree2.run(1, limits);
+    tree3.run(1, limits);
+    auto *root1 = tree1.getRootNode(), *root2 = tree2.getRootNode(), *root3 = tree3.getRootNode();
+    ASSERT_FALSE(root1->ch.empty());
+    ASSERT_EQ(root1->ch.size(), root2->ch.size());
+    bool other_seed_differs = root1->ch.size() != root3->ch.size();
+    for (std::size_t i=0; i<root1->ch.size(); ++i)
+    {
+        auto s1 = root1->ch.edge(i).stats.load(), s2 = root2->ch.edge(i).stats.load();
+        EXPECT_EQ(s1.visit_cnt, s2.visit_cnt);
+        EXPECT_EQ(s1.mean, s2.mean);
+        if (i < root3->ch.size())
+        {
+            auto s3 = root3->ch.edge(i).stats.load();
+            other_seed_differs |= s1.visit_cnt != s3.visit_cnt || s1.mean != s3.mean;
+        }
+    }
+    EXPECT_TRUE(other_seed_differs); // config.seed reaches the rollouts
+}
+
+// Uniform probabilities, or a timeout while timing_out is set
+class FlakyEvaluator: public uct::detail::PolicyEvaluator
+{
+public:
+    std::atomic<bool> timing_out {true};
+
+    virtual void evaluate(const gocnn::RequestV2 &req, std::vector<float> &possibility,
+                          Clock::time_point, std::uint64_t) override
+    {
+        if (timing_out.load())
+            throw uct::detail::CNNTimeoutError("CNN call missed its deadline");
+        possibility.assign(req.board_size(), 1.0f / req.board_size());
+    }
+};
+
+TEST(UCTTest, TestFallbackListsLastOneSearch)
+{
+    auto evaluator = std::make_shared<FlakyEvaluator>();
+    uct::detail::UCTConfig config;
+    config.evaluator = evaluator;
+
+    board::Board<9, 9> b;
+    uct::UCTTree<9, 9> tree(b, board::Player::B, 6.5, config);
+    tree.run(1, std::chrono::milliseconds(100));
+    auto *root = tree.getRootNode();
+    EXPECT_LT(0u, tree.getPolicy().cnn_fallback_cnt.load());
+    EXPECT_TRUE(root->ch.empty()); // the children expanded from the fallback list went with it
+    EXPECT_FALSE(root->block.pGoodPos);
+    EXPECT_EQ((int) uct::detail::UCTEdge::CNN_NONE, (int) root->edge->cnn_state.load());
+
+    evaluator->timing_out.store(false);
+    tree.run(1, std::chrono::milliseconds(100));
+    EXPECT_EQ((int) uct::detail::UCTEdge::CNN_READY, (int) root->edge->cnn_state.load()); // asked the CNN again
+    ASSERT_TRUE(root->block.pGoodPos);
+    EXPECT_FALSE(root->ch.empty());
+}
+
+TEST(UCTTest, TestPUCTStoresPriors)
+{
+    uct::detail::UCTConfig config = localEvaluatorConfig();
+
+    board::Board<9, 9> b;
+    uct::UCTTree<9, 9, uct::detail::PUCTSelection> tree(b, board::Player::B, 6.5, config);
+    tree.run(2, std::chrono::milliseconds(200));
+    auto *root = tree.getRootNode();
+    ASSERT_FALSE(root->ch.empty());
+    float prior_sum = 0.0f;
+    for (std::size_t i=0; i<root->ch.size(); ++i)
+    {
+        float prior = root->ch.edge(i).prior;
+        EXPECT_GT(prior, 0.0f);
+        if (i)
+        {
+            EXPECT_LE(prior, root->ch.edge(i - 1).prior); // expanded best first
+        }
+        prior_sum += prior;
+    }
+    EXPECT_LE(prior_sum, 1.0f + 1e-4f);
+}
+
+TEST(UCTTest, TestProgressiveWidening)
+{
+    uct::detail::UCTConfig config = localEvaluatorConfig();
+    config.widening_k = 1.0;
+    config.widening_alpha = 0.5;
+
+    board::Board<9, 9> b;
+    uct::UCTTree<9, 9> tree(b, board::Player::B, 6.5, config);
+    tree.run(2, std::chrono::milliseconds(200));
+    auto *root = tree.getRootNode();
+    ASSERT_TRUE(root->block.pGoodPos);
+    EXPECT_EQ(root->block.pGoodPos->size(), root->ch.capacity()); // every candidate may be admitted some day
+    std::uint32_t visit_cnt = root->edge->stats.getVisitCnt();
+    ASSERT_GT(visit_cnt, 0u);
+    std::size_t admitted = std::max<std::size_t>(1, (std::size_t) std::sqrt((double) visit_cnt));
+    EXPECT_GE(root->ch.size(), 1u);
+    EXPECT_LE(root->ch.size(), admitted);
+    // the child range grew with the admission limit instead of being sized for every candidate
+    EXPECT_GE(root->ch.reserved(), root->ch.size());
+    EXPECT_LE(root->ch.reserved(), std::max(2 * admitted, admitted + 4));
+}
+
+TEST(UCBSelectTest, TestPUCTPrefersPriorAmongEqualStats)
+{
+    std::vector<uct::detail::UCTEdge> edges(6);
+    for (std::size_t i=0; i<edges.size(); ++i)
+    {
+        edges[i].stats.store(10, 0.5f);
+        edges[i].default_policy_done.store(true);
+        edges[i].cnn_state.store(uct::detail::UCTEdge::CNN_READY);
+        edges[i].prior = 0.1f;
+    }
+    edges[4].prior = 0.5f;
+    uct::detail::SelectParams params {1.5f * std::sqrt(60.0f), 1.0f, 0.0f};
+    float best_val;
+    EXPECT_EQ(4u, uct::detail::select_best<uct::detail::PUCTScore>(edges.data(), edges.size(), params, best_val));
+    EXPECT_FLOAT_EQ(uct::detail::puct_value(edges[4], params), best_val);
+    EXPECT_EQ(0u, uct::detail::select_ucb(edges.data(), edges.size(), params)); // UCB1 ignores the prior
+}
+
 TEST(UCTTest, DISABLED_TestUCT9x9) // Disabled due to lack of 9x9 CNN Server
 {
     auto logger = getGlobalLogger();
@@ -170,6 +848,78 @@ public:
     }
 };
 
+// Accepts every connection and never answers: a CNN server that hangs
+class SilentCNNServer
+{
+    io_service service;
+    ip::tcp::acceptor acceptor;
+    std::vector<std::unique_ptr<ip::tcp::socket>> sockets; // service thread only
+    std::thread thread;
+
+    void accept()
+    {
+        sockets.emplace_back(new ip::tcp::socket(service));
+        acceptor.async_accept(*sockets.back(), [this](const boost::system::error_code &ec) {
+            if (!ec)
+                accept();
+        });
+    }
+public:
+    explicit SilentCNNServer(unsigned short port):
+            acceptor(service, ip::tcp::endpoint(ip::address::from_string("127.0.0.1"), port))
+    {
+        accept();
+        thread = std::thread([this]() { service.run(); });
+    }
+
+    ~SilentCNNServer()
+    {
+        service.stop();
+        thread.join();
+    }
+};
+
+// A pondering search has no deadline, so only the stop gets its thread out of a CNN call
+TEST(UCTTest, TestStopAbortsBlockedCNNCall)
+{
+    for (bool batching: {false, true})
+    {
+        SilentCNNServer server(7611);
+        uct::detail::UCTConfig config;
+        config.cnn_batching = batching;
+        board::Board<9, 9> b;
+        uct::UCTTree<9, 9> tree(b, board::Player::B, 6.5, "127.0.0.1", 7611, config);
+        tree.startSearch(1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        auto start = std::chrono::steady_clock::now();
+        tree.stop();
+        EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1)) << "batching " << batching;
+        EXPECT_LT(0u, tree.getPolicy().cnn_fallback_cnt.load()) << "batching " << batching;
+    }
+}
+
+// The pondering API on a hung CNN server: advance() stops the search out of its blocked call, and a
+// time-limited search ends on time
+TEST(UCTTest, TestPonderingAPIDoesntWaitForCNN)
+{
+    using Clock = std::chrono::steady_clock;
+    SilentCNNServer server(7612);
+    board::Board<9, 9> b;
+    uct::UCTTree<9, 9> tree(b, board::Player::B, 6.5, "127.0.0.1", 7612, uct::detail::UCTConfig());
+    tree.startSearch(2);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    auto start = Clock::now();
+    tree.advance(board::Board<9, 9>::PointType(4, 4));
+    EXPECT_LT(Clock::now() - start, std::chrono::seconds(1));
+    EXPECT_FALSE(tree.isSearching());
+
+    start = Clock::now();
+    tree.startSearch(2, std::chrono::milliseconds(100));
+    tree.waitResult();
+    EXPECT_LT(Clock::now() - start, std::chrono::seconds(1));
+    EXPECT_LT(0u, tree.getPolicy().cnn_fallback_cnt.load());
+}
+
 // disabled due to our new compact format
 TEST(UCTTest, DISABLED_TestUCT2)
 {